@@ -0,0 +1,147 @@
+/*
+   Copyright 2014 Witold Piłat
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Synthetic IRC traffic for the replay benchmark (DEBUG_BENCHMARK
+// build). After registration comes a NAMES burst of all users and then
+// rounds of !add/!remove churn and netsplit QUIT/JOIN storms. Nicks,
+// the first channel and pickups are taken from the bot's configuration.
+//
+//     gentranscript [users] [rounds] [seed] > transcript
+
+#define main jk2pugbot_main
+#include "../jk2pugbot.c"
+#undef main
+
+#define SERVER_NAME "irc.bench.example"
+#define BOT_NICK networksArray[0].nick
+#define CHANNEL channelsArray[0].name
+#define NAMES_LINE_LEN 400
+
+bool	*renamed;
+
+void printNick(int user)
+{
+	printf(renamed[user] ? "Renamed%d" : "player%d", user);
+}
+
+void printPrefix(int user)
+{
+	putchar(':');
+	printNick(user);
+	printf("!~user%d@host%d.bench.example ", user, user % 251);
+}
+
+void genRegistration(int users)
+{
+	int	len = 0;
+	int	i;
+
+	printf(":%s 001 %s :Welcome to the benchmark network\r\n", SERVER_NAME, BOT_NICK);
+	printf(":%s 005 %s NICKLEN=15 TARGMAX=PRIVMSG:4,NOTICE:4 :are supported by this server\r\n",
+	       SERVER_NAME, BOT_NICK);
+	printf(":%s!~%s@bot.bench.example JOIN %s\r\n", BOT_NICK, BOT_NICK, CHANNEL);
+
+	for (i = 0; i < users; i++) {
+		if (!len)
+			len = printf(":%s 353 %s = %s :%s", SERVER_NAME, BOT_NICK,
+				     CHANNEL, i ? "" : BOT_NICK);
+		len += printf(" %splayer%d", rand() % 20 ? "" : "@", i);
+		if (len > NAMES_LINE_LEN) {
+			printf("\r\n");
+			len = 0;
+		}
+	}
+	if (len)
+		printf("\r\n");
+	printf(":%s 366 %s %s :End of /NAMES list.\r\n", SERVER_NAME, BOT_NICK, CHANNEL);
+}
+
+void genChurn(int users)
+{
+	int	pickups = sizeof(pickupsArray) / sizeof(*pickupsArray);
+	int	user;
+	int	i;
+	int	j;
+
+	for (i = 0; i < users / 10; i++) {
+		user = rand() % users;
+		printPrefix(user);
+
+		switch (rand() % 10) {
+		case 0:
+			printf("PRIVMSG %s :!who\r\n", CHANNEL);
+			break;
+		case 1:
+			renamed[user] = !renamed[user];
+			printf("NICK :");
+			printNick(user);
+			printf("\r\n");
+			break;
+		case 2:
+		case 3:
+		case 4:
+			printf("PRIVMSG %s :!remove\r\n", CHANNEL);
+			break;
+		default:
+			printf("PRIVMSG %s :!add", CHANNEL);
+			for (j = rand() % 3; j >= 0; j--)
+				printf(" %s", pickupsArray[rand() % pickups].name);
+			printf("\r\n");
+		}
+	}
+}
+
+// A tenth of the channel splits off and comes back
+void genStorm(int users)
+{
+	int	first = rand() % users;
+	int	count = users / 10;
+	int	i;
+
+	for (i = 0; i < count; i++) {
+		printPrefix((first + i) % users);
+		printf("QUIT :*.net *.split\r\n");
+	}
+	for (i = 0; i < count; i++) {
+		printPrefix((first + i) % users);
+		printf("JOIN %s\r\n", CHANNEL);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int	users = argc > 1 ? atoi(argv[1]) : 2000;
+	int	rounds = argc > 2 ? atoi(argv[2]) : 200;
+	int	i;
+
+	if (users < 1 || rounds < 0) {
+		fprintf(stderr, "usage: %s [users] [rounds] [seed]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	srand(argc > 3 ? atoi(argv[3]) : 1);
+	renamed = calloc(users, sizeof(*renamed));
+	if (!renamed)
+		return EXIT_FAILURE;
+
+	genRegistration(users);
+	for (i = 0; i < rounds; i++) {
+		genChurn(users);
+		genStorm(users);
+		printf("PING :%s\r\n", SERVER_NAME);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,565 @@
+/*
+   Copyright 2014 Witold Piłat
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Mock IRC server for end-to-end load testing on localhost. It accepts
+// one bot connection, registers it, puts it in a channel full of
+// scripted clients and lets them !add, !remove, !who, change nicks and
+// split while measuring:
+//
+//   * PING to PONG latency,
+//   * !ping to !pong latency as the command to reply time,
+//   * time from the !add that filled a pickup to its announcement in
+//     the channel.
+//
+// Rosters are followed the way the bot keeps them, so it's known which
+// !add fills a pickup. After the run clients stay quiet for up to
+// MOCK_DRAIN seconds while replies the bot still owes come in.
+//
+// Bot's lines are subject to ircu-like flood control. Every line costs
+// 2 seconds plus one more per 120 bytes and lines aren't processed
+// while the penalty is over 10 seconds. If the unprocessed lines grow
+// over MOCK_RECVQ bytes the bot is disconnected for Excess Flood.
+//
+//     mockircd [-p port] [-u users] [-r commands/s] [-d seconds]
+//     jk2pugbot -s 127.0.0.1 -p 16667
+
+#define main jk2pugbot_main
+#include "../jk2pugbot.c"
+#undef main
+
+#include <netinet/tcp.h>
+#include <poll.h>
+
+#define MOCK_NAME "irc.mock.example"
+#define BOT_NICK networksArray[0].nick
+#define CHANNEL channelsArray[0].name
+#define MOCK_RECVQ 8192
+#define MOCK_FLOOD_BURST 10000
+#define MOCK_PING_INTERVAL 10000
+#define MOCK_PROBES 4096
+#define MOCK_FILLS 64
+#define MOCK_DRAIN 60
+#define NAMES_LINE_LEN 400
+
+// Times pickup got filled at, waiting for announcements
+typedef struct fills_s {
+	long long times[MOCK_FILLS];	// microseconds
+	int head;
+	int tail;
+} fills_t;
+
+typedef struct samples_s {
+	long long *values;	// microseconds
+	int count;
+	int size;
+} samples_t;
+
+struct {
+	int	users;
+	int	rate;		// commands per second
+	int	duration;	// seconds
+
+	int	conn;
+	char	rbuf[MOCK_RECVQ + MAX_MSG_LEN];
+	int	rlen;
+	bool	gotNick;
+	bool	gotUser;
+	bool	joined;
+	long long since;	// flood penalty clock in ms
+
+	bool	*renamed;
+	bool	*away;		// split off and not back yet
+	pickupMask_t *pickups;	// per user, pickups they are in
+	int	*count;		// per pickup, players in it
+	fills_t	*fills;		// per pickup
+
+	long long probes[MOCK_PROBES];	// !ping send times
+	int	probeHead;
+	int	probeTail;
+	long long pingSent;	// PING waiting for PONG
+
+	samples_t pongLatency;
+	samples_t replyLatency;
+	samples_t announceLatency;
+	unsigned long commands;
+	unsigned long linesIn;
+	unsigned long bytesIn;
+	unsigned long topics;
+	unsigned long floodPauses;
+	bool	excessFlood;
+} mock;
+
+long long mock_micro(void)
+{
+	return com_nanoseconds() / 1000;
+}
+
+void mock_sample(samples_t *samples, long long value)
+{
+	if (samples->count == samples->size) {
+		samples->size = samples->size ? samples->size * 2 : 256;
+		samples->values = com_realloc(samples->values,
+					      samples->size * sizeof(long long));
+	}
+	samples->values[samples->count++] = value;
+}
+
+int mock_compare(const void *a, const void *b)
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+void mock_report(const char *name, samples_t *samples)
+{
+	long long *v = samples->values;
+	int	n = samples->count;
+
+	if (!n) {
+		printf("%-22s no samples\n", name);
+		return;
+	}
+	qsort(v, n, sizeof(*v), mock_compare);
+	printf("%-22s %6d samples  p50 %8.1f ms  p99 %8.1f ms  max %8.1f ms\n",
+	       name, n, v[n / 2] / 1e3, v[n * 99 / 100] / 1e3, v[n - 1] / 1e3);
+}
+
+void mock_send(const char *format, ...)
+{
+	char	buf[4 * MAX_MSG_LEN];
+	va_list	ap;
+	int	len;
+
+	va_start(ap, format);
+	len = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+
+	if (mock.conn != -1 && write(mock.conn, buf, len) != len) {
+		perror("mockircd: write");
+		close(mock.conn);
+		mock.conn = -1;
+	}
+}
+
+const char *mock_nick(int user)
+{
+	static char nick[32];
+
+	snprintf(nick, sizeof(nick), mock.renamed[user] ? "Renamed%d" : "player%d", user);
+	return nick;
+}
+
+// Prefix of a scripted client
+const char *mock_prefix(int user)
+{
+	static char prefix[96];
+
+	snprintf(prefix, sizeof(prefix), ":%s!~user%d@host%d.mock.example",
+		 mock_nick(user), user, user % 251);
+	return prefix;
+}
+
+void mock_join(void)
+{
+	char	line[MAX_MSG_LEN];
+	int	len = 0;
+	int	i;
+
+	mock_send(":%s!~%s@bot.mock.example JOIN %s\r\n", BOT_NICK, BOT_NICK, CHANNEL);
+	for (i = 0; i < mock.users; i++) {
+		if (!len)
+			len = snprintf(line, sizeof(line), ":%s 353 %s = %s :%s",
+				       MOCK_NAME, BOT_NICK, CHANNEL, i ? "" : BOT_NICK);
+		len += snprintf(line + len, sizeof(line) - len, " %splayer%d",
+				i % 20 ? "" : "@", i);
+		if (len > NAMES_LINE_LEN) {
+			mock_send("%s\r\n", line);
+			len = 0;
+		}
+	}
+	if (len)
+		mock_send("%s\r\n", line);
+	mock_send(":%s 366 %s %s :End of /NAMES list.\r\n", MOCK_NAME, BOT_NICK, CHANNEL);
+	mock_send(":ChanServ!cs@services.mock.example MODE %s +o %s\r\n",
+		  CHANNEL, BOT_NICK);
+	mock.joined = true;
+}
+
+int mock_outstandingFills(void)
+{
+	int	n = 0;
+	int	i;
+
+	for (i = 0; i < sizeof(pickupsArray) / sizeof(*pickupsArray); i++)
+		n += (mock.fills[i].head - mock.fills[i].tail + MOCK_FILLS) % MOCK_FILLS;
+	return n;
+}
+
+// User leaves every pickup, like on !remove, QUIT or a game start
+void mock_leave(int user)
+{
+	int	i;
+
+	for (i = 0; i < sizeof(pickupsArray) / sizeof(*pickupsArray); i++) {
+		if (mock.pickups[user] & (1u << i))
+			mock.count[i]--;
+	}
+	mock.pickups[user] = 0;
+}
+
+// User adds to a pickup. When that fills it the bot starts the game
+// and its players leave all pickups.
+void mock_add(int user, int pickup)
+{
+	fills_t	*fills = &mock.fills[pickup];
+	int	i;
+
+	if (mock.pickups[user] & (1u << pickup))
+		return;
+	mock.pickups[user] |= 1u << pickup;
+	mock.count[pickup]++;
+	if (mock.count[pickup] != pickupsArray[pickup].max)
+		return;
+
+	if ((fills->head + 1) % MOCK_FILLS != fills->tail) {
+		fills->times[fills->head] = mock_micro();
+		fills->head = (fills->head + 1) % MOCK_FILLS;
+	}
+	for (i = 0; i < mock.users; i++) {
+		if (mock.pickups[i] & (1u << pickup))
+			mock_leave(i);
+	}
+}
+
+bool mock_isTarget(const char *targets, int len, const char *name)
+{
+	int	nameLen = strlen(name);
+	const char *end = targets + len;
+
+	while (targets < end) {
+		const char *comma = memchr(targets, ',', end - targets);
+		int	targetLen = (comma ? comma : end) - targets;
+
+		if (targetLen == nameLen && !strncmp(targets, name, nameLen))
+			return true;
+		targets += targetLen + 1;
+	}
+	return false;
+}
+
+// Pickup announcement. Highlights go out in several lines, the one to
+// the channel comes last.
+void mock_announced(const char *targets, int len, const char *text)
+{
+	int	i;
+
+	if (!mock_isTarget(targets, len, CHANNEL))
+		return;
+	if (*text == '\x02')
+		text++;
+
+	for (i = 0; i < sizeof(pickupsArray) / sizeof(*pickupsArray); i++) {
+		const char *name = pickupsArray[i].name;
+		fills_t	*fills = &mock.fills[i];
+
+		if (strncmp(text, name, strlen(name)) ||
+		    strncmp(text + strlen(name), " pickup ", 8))
+			continue;
+		if (fills->head != fills->tail) {
+			mock_sample(&mock.announceLatency,
+				    mock_micro() - fills->times[fills->tail]);
+			fills->tail = (fills->tail + 1) % MOCK_FILLS;
+		}
+		return;
+	}
+}
+
+void mock_line(char *line, int len)
+{
+	char	*text;
+	long long now = mock_micro();
+
+	mock.linesIn++;
+	mock.bytesIn += len + 2;
+
+	if (!strncmp(line, "NICK ", 5)) {
+		mock.gotNick = true;
+	} else if (!strncmp(line, "USER ", 5)) {
+		mock.gotUser = true;
+	} else if (!strncmp(line, "JOIN ", 5)) {
+		if (!mock.joined)
+			mock_join();
+	} else if (!strncmp(line, "PONG", 4)) {
+		if (mock.pingSent)
+			mock_sample(&mock.pongLatency, now - mock.pingSent);
+		mock.pingSent = 0;
+	} else if (!strncmp(line, "TOPIC ", 6)) {
+		mock.topics++;
+	} else if (!strncmp(line, "QUIT", 4)) {
+		close(mock.conn);
+		mock.conn = -1;
+	} else if (!strncmp(line, "PRIVMSG ", 8) && (text = strstr(line, " :"))) {
+		text += 2;
+		if (!strcmp(text, "!pong") && mock.probeHead != mock.probeTail) {
+			mock_sample(&mock.replyLatency, now - mock.probes[mock.probeTail]);
+			mock.probeTail = (mock.probeTail + 1) % MOCK_PROBES;
+		} else if (strstr(text, "pickup is ready to start!")) {
+			mock_announced(line + 8, text - 2 - (line + 8), text);
+		}
+	}
+
+	if (mock.gotNick && mock.gotUser) {
+		mock.gotNick = mock.gotUser = false;
+		mock_send(":%s 001 %s :Welcome to the mock network\r\n", MOCK_NAME, BOT_NICK);
+		mock_send(":%s 005 %s NICKLEN=15 TARGMAX=PRIVMSG:4,NOTICE:4 :are supported by this server\r\n",
+			  MOCK_NAME, BOT_NICK);
+	}
+}
+
+// Process received lines as fast as flood control allows
+void mock_process(void)
+{
+	long long now = com_milliseconds();
+	char	*start = mock.rbuf;
+	char	*end;
+	bool	paused = false;
+
+	while ((end = memchr(start, '\n', mock.rbuf + mock.rlen - start))) {
+		if (mock.since < now)
+			mock.since = now;
+		if (mock.since - now > MOCK_FLOOD_BURST) {
+			paused = true;
+			break;
+		}
+		mock.since += 2000 + (end + 1 - start) * 1000 / 120;
+
+		*end = '\0';
+		if (end > start && end[-1] == '\r')
+			end[-1] = '\0';
+		mock_line(start, strlen(start));
+		start = end + 1;
+	}
+	if (paused && start == mock.rbuf)
+		mock.floodPauses++;
+
+	mock.rlen -= start - mock.rbuf;
+	memmove(mock.rbuf, start, mock.rlen);
+
+	if (mock.rlen > MOCK_RECVQ) {
+		mock_send("ERROR :Closing Link: %s (Excess Flood)\r\n", BOT_NICK);
+		close(mock.conn);
+		mock.conn = -1;
+		mock.excessFlood = true;
+	}
+}
+
+void mock_receive(void)
+{
+	int	len;
+
+	len = read(mock.conn, mock.rbuf + mock.rlen, sizeof(mock.rbuf) - mock.rlen);
+	if (len <= 0) {
+		close(mock.conn);
+		mock.conn = -1;
+		return;
+	}
+	mock.rlen += len;
+	mock_process();
+}
+
+// One scripted client does something
+void mock_command(void)
+{
+	int	pickups = sizeof(pickupsArray) / sizeof(*pickupsArray);
+	int	user = rand() % mock.users;
+	int	pickup;
+	int	action = rand() % 20;
+
+	if (mock.away[user]) {
+		mock_send("%s JOIN %s\r\n", mock_prefix(user), CHANNEL);
+		mock.away[user] = false;
+		return;
+	}
+
+	mock.commands++;
+	if (action < 10) {
+		pickup = rand() % pickups;
+		mock_send("%s PRIVMSG %s :!add %s\r\n", mock_prefix(user),
+			  CHANNEL, pickupsArray[pickup].name);
+		mock_add(user, pickup);
+	} else if (action < 14) {
+		mock_send("%s PRIVMSG %s :!remove\r\n", mock_prefix(user), CHANNEL);
+		mock_leave(user);
+	} else if (action < 15) {
+		mock_send("%s PRIVMSG %s :!who\r\n", mock_prefix(user), CHANNEL);
+	} else if (action < 17) {
+		if ((mock.probeHead + 1) % MOCK_PROBES != mock.probeTail) {
+			mock.probes[mock.probeHead] = mock_micro();
+			mock.probeHead = (mock.probeHead + 1) % MOCK_PROBES;
+			mock_send("%s PRIVMSG %s :!ping\r\n", mock_prefix(user), CHANNEL);
+		}
+	} else if (action < 18) {
+		char oldPrefix[96];
+
+		strcpy(oldPrefix, mock_prefix(user));
+		mock.renamed[user] = !mock.renamed[user];
+		mock_send("%s NICK :%s\r\n", oldPrefix, mock_nick(user));
+	} else {
+		mock_send("%s QUIT :*.net *.split\r\n", mock_prefix(user));
+		mock.away[user] = true;
+		mock_leave(user);
+	}
+}
+
+int mock_listen(const char *port)
+{
+	struct sockaddr_in addr = {
+		.sin_family	= AF_INET,
+		.sin_port	= htons(atoi(port)),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int	fd;
+	int	one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		com_perror("socket");
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1))
+		com_perror("bind");
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	const char *port = "16667";
+	struct pollfd pfd;
+	long long start;
+	long long now;
+	long long nextCommand;
+	long long nextPing;
+	long long interval;
+	int	listener;
+	int	opt;
+	int	one = 1;
+
+	mock.users = 2000;
+	mock.rate = 20;
+	mock.duration = 60;
+	while ((opt = getopt(argc, argv, "p:u:r:d:")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = optarg;
+			break;
+		case 'u':
+			mock.users = atoi(optarg);
+			break;
+		case 'r':
+			mock.rate = atoi(optarg);
+			break;
+		case 'd':
+			mock.duration = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-p port] [-u users] [-r commands/s] [-d seconds]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (mock.users < 1 || mock.rate < 1)
+		return EXIT_FAILURE;
+
+	initLog();
+	initTrace();
+
+	mock.renamed = calloc(mock.users, sizeof(bool));
+	mock.away = calloc(mock.users, sizeof(bool));
+	mock.pickups = calloc(mock.users, sizeof(pickupMask_t));
+	mock.count = calloc(sizeof(pickupsArray) / sizeof(*pickupsArray), sizeof(int));
+	mock.fills = calloc(sizeof(pickupsArray) / sizeof(*pickupsArray), sizeof(fills_t));
+	if (!mock.renamed || !mock.away || !mock.pickups || !mock.count || !mock.fills)
+		return EXIT_FAILURE;
+
+	listener = mock_listen(port);
+	printf("Waiting for the bot on 127.0.0.1:%s\n", port);
+	fflush(stdout);
+	mock.conn = accept(listener, NULL, NULL);
+	if (mock.conn == -1)
+		com_perror("accept");
+	setsockopt(mock.conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	interval = 1000000 / mock.rate;
+	start = mock_micro();
+	nextCommand = start;
+	nextPing = start + MOCK_PING_INTERVAL * 1000LL;
+
+	while (mock.conn != -1) {
+		now = mock_micro();
+		if (now - start >= mock.duration * 1000000LL) {
+			// Wait for replies the bot owes, but not forever
+			if (mock.probeHead == mock.probeTail && !mock_outstandingFills())
+				break;
+			if (now - start >= (mock.duration + MOCK_DRAIN) * 1000000LL)
+				break;
+			nextCommand = now + interval;
+		}
+
+		if (mock.joined) {
+			for (; nextCommand <= now; nextCommand += interval)
+				mock_command();
+			if (nextPing <= now) {
+				if (!mock.pingSent) {
+					mock.pingSent = now;
+					mock_send("PING :%s\r\n", MOCK_NAME);
+				}
+				nextPing = now + MOCK_PING_INTERVAL * 1000LL;
+			}
+		} else {
+			nextCommand = nextPing = now;
+		}
+
+		// Flood control might be holding lines back
+		if (mock.rlen)
+			mock_process();
+
+		pfd.fd = mock.conn;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 10) > 0)
+			mock_receive();
+	}
+
+	printf("%lu commands from %d clients in %d s, %lu lines %lu bytes from the bot, %lu topics\n",
+	       mock.commands, mock.users, mock.duration, mock.linesIn, mock.bytesIn,
+	       mock.topics);
+	printf("flood control paused the bot %lu times%s\n", mock.floodPauses,
+	       mock.excessFlood ? ", bot was disconnected for Excess Flood" : "");
+	mock_report("PING to PONG", &mock.pongLatency);
+	mock_report("!ping to !pong", &mock.replyLatency);
+	mock_report("filled to announced", &mock.announceLatency);
+	printf("%d !ping replies and %d announcements outstanding after %.1f s\n",
+	       (mock.probeHead - mock.probeTail + MOCK_PROBES) % MOCK_PROBES,
+	       mock_outstandingFills(), (mock_micro() - start) / 1e6);
+
+	if (mock.conn != -1)
+		close(mock.conn);
+	close(listener);
+	return mock.excessFlood ? EXIT_FAILURE : EXIT_SUCCESS;
+}
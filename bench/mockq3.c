@@ -0,0 +1,354 @@
+/*
+   Copyright 2014 Witold Piłat
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Farm of mock Q3/JK2 game servers on localhost. Server i listens on
+// UDP port base+i and answers getinfo with infoResponse and getstatus
+// with statusResponse and a player list. Faults can be injected:
+//
+//   -l, -j  reply latency and random jitter on top of it, in ms,
+//   -L      percent of queries lost,
+//   -t      percent of replies truncated at a random length,
+//   -s      number of servers (the last ones) which never reply.
+//
+//     mockq3 [-p base port] [-n servers] [-l ms] [-j ms] [-L %] [-t %] [-s silent] [-d seconds]
+
+#define main jk2pugbot_main
+#include "../jk2pugbot.c"
+#undef main
+
+#include <ctype.h>
+#include <poll.h>
+
+#define MOCK_MAXCLIENTS 16
+#define MOCK_PRIVATECLIENTS 2
+#define MOCK_MAX_REPLY 1400
+
+typedef struct delayed_s {
+	long long due;		// microseconds
+	int	server;
+	struct sockaddr_in to;
+	socklen_t tolen;
+	bool	status;		// getstatus, not getinfo
+	char	challenge[64];
+} delayed_t;
+
+struct {
+	int	servers;
+	int	basePort;
+	int	latency;	// ms
+	int	jitter;		// ms
+	int	loss;		// percent
+	int	truncate;	// percent
+	int	silent;		// last servers that never reply
+	int	duration;	// seconds or 0 to run until interrupted
+
+	struct pollfd *pfd;
+	int	*clients;
+
+	delayed_t	*heap;		// replies waiting for their due time
+	int	pending;
+	int	size;
+
+	unsigned long queries;
+	unsigned long replies;
+	unsigned long lost;
+	unsigned long truncated;
+	unsigned long ignored;	// queries to silent servers
+} mock;
+
+volatile sig_atomic_t mockQuit;
+
+long long mock_micro(void)
+{
+	return com_nanoseconds() / 1000;
+}
+
+void mock_interrupt(int sig)
+{
+	mockQuit = 1;
+}
+
+/* Reply queue
+ * functions
+ */
+
+void mock_swap(int a, int b)
+{
+	delayed_t tmp = mock.heap[a];
+
+	mock.heap[a] = mock.heap[b];
+	mock.heap[b] = tmp;
+}
+
+void mock_schedule(const delayed_t *reply)
+{
+	int	i;
+
+	if (mock.pending == mock.size) {
+		mock.size = mock.size ? mock.size * 2 : 256;
+		mock.heap = com_realloc(mock.heap, mock.size * sizeof(delayed_t));
+	}
+
+	i = mock.pending++;
+	mock.heap[i] = *reply;
+	while (i && mock.heap[(i - 1) / 2].due > mock.heap[i].due) {
+		mock_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+void mock_pop(void)
+{
+	int	i = 0;
+	int	child;
+
+	mock.heap[0] = mock.heap[--mock.pending];
+	while ((child = 2 * i + 1) < mock.pending) {
+		if (child + 1 < mock.pending &&
+		    mock.heap[child + 1].due < mock.heap[child].due)
+			child++;
+		if (mock.heap[i].due <= mock.heap[child].due)
+			break;
+		mock_swap(i, child);
+		i = child;
+	}
+}
+
+/* Game server
+ * functions
+ */
+
+int mock_info(const delayed_t *reply, char *buf)
+{
+	int	server = reply->server;
+
+	return snprintf(buf, MOCK_MAX_REPLY,
+			"\xFF\xFF\xFF\xFFinfoResponse\n"
+			"\\challenge\\%s\\protocol\\16\\hostname\\Mock server %d"
+			"\\mapname\\ctf_yavin\\clients\\%d\\sv_maxclients\\%d"
+			"\\sv_privateclients\\%d\\gametype\\7",
+			reply->challenge, server, mock.clients[server],
+			MOCK_MAXCLIENTS, MOCK_PRIVATECLIENTS);
+}
+
+int mock_status(const delayed_t *reply, char *buf)
+{
+	int	server = reply->server;
+	int	len;
+	int	i;
+
+	len = snprintf(buf, MOCK_MAX_REPLY,
+		       "\xFF\xFF\xFF\xFFstatusResponse\n"
+		       "\\sv_hostname\\Mock server %d\\mapname\\ctf_yavin"
+		       "\\sv_maxclients\\%d\\sv_privateclients\\%d\\g_gametype\\7\n",
+		       server, MOCK_MAXCLIENTS, MOCK_PRIVATECLIENTS);
+	for (i = 0; i < mock.clients[server] && len < MOCK_MAX_REPLY; i++)
+		len += snprintf(buf + len, MOCK_MAX_REPLY - len,
+				"%d %d \"Padawan%d\"\n", i * 7, 20 + i * 3, i);
+	return len < MOCK_MAX_REPLY ? len : MOCK_MAX_REPLY - 1;
+}
+
+void mock_reply(const delayed_t *reply)
+{
+	char	buf[MOCK_MAX_REPLY];
+	int	len;
+
+	len = reply->status ? mock_status(reply, buf) : mock_info(reply, buf);
+	if (rand() % 100 < mock.truncate) {
+		len = 4 + rand() % (len - 4);
+		mock.truncated++;
+	}
+
+	if (sendto(mock.pfd[reply->server].fd, buf, len, 0,
+		   (const struct sockaddr *)&reply->to, reply->tolen) == len)
+		mock.replies++;
+}
+
+void mock_receive(int server)
+{
+	char	buf[MAX_Q3_INFO_LEN + 1];
+	char	*cmd = buf + 4;
+	delayed_t	reply;
+	int	len;
+
+	reply.tolen = sizeof(reply.to);
+	len = recvfrom(mock.pfd[server].fd, buf, sizeof(buf) - 1, MSG_DONTWAIT,
+		       (struct sockaddr *)&reply.to, &reply.tolen);
+	if (len < 4 || memcmp(buf, "\xFF\xFF\xFF\xFF", 4))
+		return;
+	buf[len] = '\0';
+	mock.queries++;
+
+	// JK2 clients prefix commands with a byte that real servers skip
+	while (*cmd && !isalpha((unsigned char)*cmd))
+		cmd++;
+	if (!strncmp(cmd, "getinfo", 7))
+		reply.status = false;
+	else if (!strncmp(cmd, "getstatus", 9))
+		reply.status = true;
+	else
+		return;
+
+	if (server >= mock.servers - mock.silent) {
+		mock.ignored++;
+		return;
+	}
+	if (rand() % 100 < mock.loss) {
+		mock.lost++;
+		return;
+	}
+
+	cmd += strcspn(cmd, " \n");
+	cmd += strspn(cmd, " ");
+	len = strcspn(cmd, " \n");
+	if (len >= sizeof(reply.challenge))
+		len = sizeof(reply.challenge) - 1;
+	memcpy(reply.challenge, cmd, len);
+	reply.challenge[len] = '\0';
+
+	reply.server = server;
+	reply.due = mock_micro() + mock.latency * 1000LL;
+	if (mock.jitter)
+		reply.due += rand() % (mock.jitter * 1000);
+
+	if (reply.due <= mock_micro())
+		mock_reply(&reply);
+	else
+		mock_schedule(&reply);
+}
+
+int mock_bind(int port)
+{
+	struct sockaddr_in addr;
+	int	sock;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock == -1)
+		com_perror("socket");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)))
+		com_error("bind port %d: %s", port, strerror(errno));
+	return sock;
+}
+
+// One descriptor per server and a few spare
+void mock_raiseFileLimit(int servers)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl))
+		return;
+	if (rl.rlim_cur < servers + 16) {
+		rl.rlim_cur = servers + 16 < rl.rlim_max ? servers + 16 : rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	long long start;
+	long long now;
+	int	timeout;
+	int	opt;
+	int	i;
+
+	mock.servers = 16;
+	mock.basePort = 27960;
+	while ((opt = getopt(argc, argv, "p:n:l:j:L:t:s:d:")) != -1) {
+		switch (opt) {
+		case 'p':
+			mock.basePort = atoi(optarg);
+			break;
+		case 'n':
+			mock.servers = atoi(optarg);
+			break;
+		case 'l':
+			mock.latency = atoi(optarg);
+			break;
+		case 'j':
+			mock.jitter = atoi(optarg);
+			break;
+		case 'L':
+			mock.loss = atoi(optarg);
+			break;
+		case 't':
+			mock.truncate = atoi(optarg);
+			break;
+		case 's':
+			mock.silent = atoi(optarg);
+			break;
+		case 'd':
+			mock.duration = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-p base port] [-n servers] [-l ms] [-j ms]"
+				" [-L loss %%] [-t truncated %%] [-s silent] [-d seconds]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (mock.servers < 1 || mock.basePort < 1 ||
+	    mock.basePort + mock.servers > 65536 || mock.latency < 0 || mock.jitter < 0)
+		return EXIT_FAILURE;
+
+	initLog();
+	initTrace();
+	mock_raiseFileLimit(mock.servers);
+	mock.pfd = com_malloc(mock.servers * sizeof(struct pollfd));
+	mock.clients = com_malloc(mock.servers * sizeof(int));
+	for (i = 0; i < mock.servers; i++) {
+		mock.pfd[i].fd = mock_bind(mock.basePort + i);
+		mock.pfd[i].events = POLLIN;
+		mock.clients[i] = rand() % (MOCK_MAXCLIENTS - MOCK_PRIVATECLIENTS + 1);
+	}
+
+	signal(SIGINT, mock_interrupt);
+	signal(SIGTERM, mock_interrupt);
+	printf("%d servers on 127.0.0.1:%d-%d, %d silent\n", mock.servers,
+	       mock.basePort, mock.basePort + mock.servers - 1, mock.silent);
+	fflush(stdout);
+
+	start = mock_micro();
+	while (!mockQuit) {
+		now = mock_micro();
+		if (mock.duration && now - start >= mock.duration * 1000000LL)
+			break;
+
+		while (mock.pending && mock.heap[0].due <= now) {
+			mock_reply(&mock.heap[0]);
+			mock_pop();
+		}
+
+		timeout = 100;
+		if (mock.pending && (mock.heap[0].due - now) / 1000 < timeout)
+			timeout = (mock.heap[0].due - now + 999) / 1000;
+		if (poll(mock.pfd, mock.servers, timeout) <= 0)
+			continue;
+
+		for (i = 0; i < mock.servers; i++)
+			if (mock.pfd[i].revents & POLLIN)
+				mock_receive(i);
+	}
+
+	printf("%lu queries, %lu replies (%lu truncated), %lu lost, %lu to silent servers\n",
+	       mock.queries, mock.replies, mock.truncated, mock.lost, mock.ignored);
+	return EXIT_SUCCESS;
+}
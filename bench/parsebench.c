@@ -0,0 +1,158 @@
+/*
+   Copyright 2014 Witold Piłat
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// IRC message parser throughput benchmark. Compares parseMessage()
+// with the strtok based parser it replaced. Timestamp printing that
+// the old parser did for every line is left out, so only tokenizing
+// is compared.
+
+#define main jk2pugbot_main
+#include "../jk2pugbot.c"
+#undef main
+
+typedef struct oldMessage_s {
+	struct prefix_s prefix;
+	char *command;
+	char *parameter[14];
+	char *trailing;
+} oldMessage_t;
+
+bool parseMessageOld(char *ptr, char *msgEnd, oldMessage_t *message)
+{
+	char *trailingptr;
+
+	if (msgEnd - ptr > MAX_MSG_LEN - 2)
+		return false;
+
+	*msgEnd = '\0';
+
+	memset(message, 0, sizeof(*message));
+
+	// Find <trailing> sequence
+	trailingptr = strstr(ptr, " :");
+	if (trailingptr) {
+		trailingptr[0] = '\0';
+		trailingptr += 2;
+	}
+	message->trailing = trailingptr;
+
+	// Parse prefix and command
+	strtok(ptr, " ");
+	if (ptr[0] == ':') {
+		char *prefixptr;
+		ptr++;
+		message->prefix.nick = strtok_r(ptr, "!", &prefixptr);
+		message->prefix.user = strtok_r(NULL, "@", &prefixptr);
+		message->prefix.host = strtok_r(NULL, "", &prefixptr);
+
+		ptr = strtok(NULL, " ");
+		if (!ptr)
+			return false;
+	} else {
+		memset(&message->prefix, 0, sizeof(message->prefix));
+	}
+	message->command = ptr;
+
+	// Parse <middle> parameters
+	int i = -1;
+	do {
+		i++;
+		message->parameter[i] = strtok(NULL, " ");
+	} while (i < 14 && message->parameter[i] != NULL);
+
+	return true;
+}
+
+const char * const corpus[] = {
+	"PING :irc.quakenet.org",
+	":fau!~fau@fau.users.quakenet.org PRIVMSG #jk2pugbot :!add ctf 4v4 duel",
+	":someone!~user@host-12-34-56-78.example.net PRIVMSG #jk2pugbot :anyone up for a duel tonight?",
+	":player!~p@10.0.0.1 JOIN #jk2pugbot",
+	":player!~p@10.0.0.1 PART #jk2pugbot :Leaving",
+	":quitter!~q@dynamic.isp.example.org QUIT :Ping timeout: 240 seconds",
+	":oldnick!~o@host NICK :newnick",
+	":Q!TheQBot@CServe.quakenet.org MODE #jk2pugbot +o fau",
+	":irc.quakenet.org 353 JK2PUGBOT = #jk2pugbot :JK2PUGBOT @fau @Q +voiced alice bob carol dave eve frank grace heidi ivan judy mallory niaj olivia peggy rupert sybil trent victor walter",
+	":irc.quakenet.org 005 JK2PUGBOT WHOX WALLCHOPS WALLVOICES USERIP CPRIVMSG CNOTICE SILENCE=15 MODES=6 MAXCHANNELS=20 MAXBANS=45 NICKLEN=15 :are supported by this server",
+	"@time=2014-06-01T12:00:00.000Z;account=fau :fau!~fau@fau.users.quakenet.org PRIVMSG #jk2pugbot :!who",
+};
+
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(*corpus))
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	char buf[MAX_MSG_LEN + MAX_TAGS_LEN + 1];
+	size_t len[CORPUS_SIZE];
+	size_t bytes = 0;
+	long iterations = 200000;
+	long lines;
+	long i;
+	int j;
+	unsigned sink = 0;
+	double start, oldTime, newTime;
+	message_t message;
+	oldMessage_t oldMessage;
+
+	if (argc > 1)
+		iterations = atol(argv[1]);
+
+	for (j = 0; j < CORPUS_SIZE; j++) {
+		len[j] = strlen(corpus[j]);
+		bytes += len[j];
+	}
+	lines = iterations * CORPUS_SIZE;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < CORPUS_SIZE; j++) {
+			memcpy(buf, corpus[j], len[j]);
+			if (parseMessageOld(buf, buf + len[j], &oldMessage))
+				sink += oldMessage.command[0];
+		}
+	}
+	oldTime = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < CORPUS_SIZE; j++) {
+			memcpy(buf, corpus[j], len[j]);
+			if (parseMessage(buf, buf + len[j], &message))
+				sink += message.command[0];
+		}
+	}
+	newTime = now() - start;
+
+	printf("%ld lines, %.1f MB per parser (checksum %u)\n",
+	       lines, bytes * iterations / 1e6, sink);
+	printf("strtok parser:      %8.0f ns/line %10.0f lines/s %7.1f MB/s\n",
+	       oldTime * 1e9 / lines, lines / oldTime,
+	       bytes * iterations / oldTime / 1e6);
+	printf("single-pass parser: %8.0f ns/line %10.0f lines/s %7.1f MB/s\n",
+	       newTime * 1e9 / lines, lines / newTime,
+	       bytes * iterations / newTime / 1e6);
+	printf("speedup: %.2fx\n", oldTime / newTime);
+
+	return 0;
+}
@@ -0,0 +1,208 @@
+/*
+   Copyright 2014 Witold Piłat
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Game server query path benchmark. For every server count it
+// recommends that many servers from mockq3 for a pickup and announces
+// them over and over with a cold status cache, through the bot's own
+// announceServers, event loop and receiveQ3Info. It reports
+// announcement latency, query round trip times and how many servers
+// timed out.
+//
+//     mockq3 -n 256 [faults] &
+//     querybench [-p base port] [-r rounds] [servers...]
+
+#define main jk2pugbot_main
+#include "../jk2pugbot.c"
+#undef main
+
+#include <arpa/inet.h>
+
+#define BENCH_TARGET "#bench"
+
+const int defaultCounts[] = { 1, 4, 16, 64, 256 };
+
+pickup_t benchPickup = { .name = "bench" };
+
+server_t *makeServers(int count, int basePort)
+{
+	server_t *servers = calloc(count, sizeof(server_t));
+	char	buf[32];
+	int	i;
+
+	if (!servers)
+		com_perror("calloc");
+
+	for (i = 0; i < count; i++) {
+		server_t *server = &servers[i];
+
+		snprintf(buf, sizeof(buf), "mock%d", i);
+		server->name = com_strdup(buf);
+		server->address = "127.0.0.1";
+		snprintf(buf, sizeof(buf), "%d", basePort + i);
+		server->port = com_strdup(buf);
+		server->type = SV_Q3;
+
+		// Skip the resolver thread
+		server->resolve.resolved = true;
+		server->resolve.addr.sin_family = AF_INET;
+		server->resolve.addr.sin_port = htons(basePort + i);
+		inet_pton(AF_INET, server->address, &server->resolve.addr.sin_addr);
+
+		benchPickup.serverList = pushServer(benchPickup.serverList, server);
+	}
+	return servers;
+}
+
+void freeServers(server_t *servers, int count)
+{
+	serverNode_t *next;
+	int	i;
+
+	for (; benchPickup.serverList; benchPickup.serverList = next) {
+		next = benchPickup.serverList->next;
+		free(benchPickup.serverList);
+	}
+	for (i = 0; i < count; i++) {
+		free((char *)servers[i].name);
+		free((char *)servers[i].port);
+	}
+	free(servers);
+}
+
+// Forget the status cache and whatever was printed
+void resetRound(server_t *servers, int count)
+{
+	int	i;
+
+	for (i = 0; i < count; i++) {
+		servers[i].status = SV_UNKNOWN;
+		servers[i].updated = 0;
+		servers[i].queryDeadline = 0;
+	}
+	bot_flush();
+	for (i = 0; i < OUT_CLASSES; i++)
+		sq_clear(&bot.net->outq[i]);
+	bot.net->outLines = 0;
+}
+
+int compareLatency(const void *a, const void *b)
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+void runBenchmark(int count, int basePort, int rounds)
+{
+	pickupNode_t *node = pushPickup(NULL, &benchPickup);
+	server_t *servers = makeServers(count, basePort);
+	long long *latency = com_malloc(rounds * sizeof(long long));	// microseconds
+	unsigned long up = 0;
+	unsigned long down = 0;
+	long long start;
+	int	round;
+	int	i;
+
+	memset(&bot.stats, 0, sizeof(bot.stats));
+	bot.servers = servers;
+	bot.serverCount = count;
+
+	for (round = 0; round < rounds; round++) {
+		resetRound(servers, count);
+
+		start = com_nanoseconds();
+		announceServers(node, BENCH_TARGET);
+		while (bot.announcements)
+			ev_dispatch(-1);
+		latency[round] = (com_nanoseconds() - start) / 1000;
+
+		for (i = 0; i < count; i++) {
+			if (servers[i].status == SV_UP)
+				up++;
+			else
+				down++;
+		}
+	}
+
+	qsort(latency, rounds, sizeof(*latency), compareLatency);
+	printf("%5d %8.2f %8.2f %8.2f %8lld %8lld %7.1f%% %8lu\n", count,
+	       latency[rounds / 2] / 1e3, latency[rounds * 99 / 100] / 1e3,
+	       latency[rounds - 1] / 1e3,
+	       hist_quantile(&bot.stats.queryRtt, 0.5),
+	       hist_quantile(&bot.stats.queryRtt, 0.99),
+	       100.0 * down / (up + down), bot.stats.queryTimeouts);
+
+	resetRound(servers, count);
+	bot.servers = NULL;
+	bot.serverCount = 0;
+	freeServers(servers, count);
+	popPickup(node);
+	free(latency);
+}
+
+int main(int argc, char **argv)
+{
+	int	basePort = 27960;
+	int	rounds = 20;
+	int	count;
+	int	opt;
+	int	i;
+
+	while ((opt = getopt(argc, argv, "p:r:")) != -1) {
+		switch (opt) {
+		case 'p':
+			basePort = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-p base port] [-r rounds] [servers...]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (basePort < 1 || rounds < 1)
+		return EXIT_FAILURE;
+
+	initLog();
+	initTrace();
+	ev_init();
+	initNetworks();
+	initQueries();
+	// Announcements are queued for the first network, never connected
+	bot.net = &bot.networks[0];
+
+	printf("announcement latency in ms, query round trip in ms, %d rounds\n", rounds);
+	printf("%5s %8s %8s %8s %8s %8s %8s %8s\n", "srvs", "p50", "p99", "max",
+	       "rtt p50", "rtt p99", "down", "timeouts");
+	if (optind == argc) {
+		for (i = 0; i < sizeof(defaultCounts) / sizeof(*defaultCounts); i++)
+			runBenchmark(defaultCounts[i], basePort, rounds);
+	}
+	for (i = optind; i < argc; i++) {
+		count = atoi(argv[i]);
+		if (count < 1 || basePort + count > 65536) {
+			fprintf(stderr, "%s: Bad server count %s\n", argv[0], argv[i]);
+			return EXIT_FAILURE;
+		}
+		runBenchmark(count, basePort, rounds);
+	}
+	log_flush();
+	return EXIT_SUCCESS;
+}
@@ -22,18 +22,32 @@
  */
 
 const char * const	botVersion	= "beta";
-const char * const	botHost		= "irc.quakenet.org";
-const char * const	botPort		= "6667";
-const char * const	botNick		= "JK2PUGBOT";
-const char * const	botRealName	= "";
-const char * const	botChannel	= "#jk2pugbot";
 const char * const	botTopic	= "Welcome to #jk2pugbot";
-const char * const	botQpassword	= NULL;	// Password to auth with Q or NULL
 const int	botTimeout	= 300;		// Try to reconnect after this number of seconds
 const bool	botSilentWho	= true;		// Don't announce players in the main channel
 const bool	botPrintEmpty	= false;	// Print empty pickups in channel topic
 const bool	botStrict1459	= false;	// If your server runs in strict RFC 1459 mode
-
+const int	botQueryTimeout	= 1000;		// Wait this number of milliseconds for game servers
+const int	botServerTTL	= 30;		// Use cached game server status for this number of seconds
+const int	botServerMaxAge	= 300;		// After that serve it and refresh in background until then
+const int	botResolveInterval = 3600;	// Look up server addresses again after this number of seconds
+const int	botMaxPlayers	= 4096;		// Don't track more channel users than that
+const int	botMaxSendQueue	= 1 << 20;	// Drop output when this many bytes wait for the irc server
+const int	botFloodLineCost = 2000;	// Milliseconds of flood penalty the irc server adds per line
+const int	botFloodByteRate = 120;		// and one more for each this many bytes of it
+const int	botFloodBurst	= 10000;	// Stop sending when the penalty exceeds that
+const int	botTopicDelay	= 3000;		// Wait this number of milliseconds for more changes to the topic
+const int	botTopicMaxDelay = 15000;	// but not longer than that after the first one
+const int	botLogLevel	= LL_INFO;	// Don't log messages less severe than that
+const bool	botLogTraffic	= true;		// Log lines sent to and received from the irc server
+const char * const	botTrafficFile	= NULL;	// Log them to this file in binary form instead or NULL
+const char * const	botMetricsFile	= NULL;	// Keep Prometheus metrics in this file or NULL
+const int	botMetricsInterval = 15;	// Rewrite it after this number of seconds
+const char * const	botTraceFile	= NULL;	// Write Chrome trace events to this file or NULL
+const char * const	botSnapshotFile	= NULL;	// Keep rosters, topics and server status in this file or NULL
+const char * const	botConfigFile	= NULL;	// Read pickups and servers from this file instead of the arrays below
+
+// Pickup games channels can choose from
 pickup_t pickupsArray[] = {
 	{ .name = "CTF", .max = 16 },
 	{ .name = "4v4", .max = 8 },
@@ -42,9 +56,20 @@ pickup_t pickupsArray[] = {
 	{ .name = "ffa", .max = 0 },
 };
 
+// IRC networks to connect to, all at once. Set .qPassword to auth with Q.
+network_t networksArray[] = {
+	{ .name = "QuakeNet", .host = "irc.quakenet.org", .port = "6667", .nick = "JK2PUGBOT", .realName = "" },
+};
+
+// Channels to serve, networks they are on and pickup games played in
+// each of them. Every channel has its own rosters and topic.
+channel_t channelsArray[] = {
+	{ .network = "QuakeNet", .name = "#jk2pugbot", .games = "CTF 4v4 2v2 duel ffa" },
+};
+
 // These servers will be recommended when announcing a pickup game.
 // If your game doesn't use quake 3 engine then don't set the .type variable.
-const server_t serversArray[] = {
+server_t serversArray[] = {
 	{ .name = "[united] Coruscant", .address = "185.44.107.108", .port = "28070", .games = "CTF", .type = SV_Q3 },
 	{ .name = "jk2.ouned.de", .address = "185.44.107.108", .port = "28071", .games = "CTF", .type = SV_Q3 },
 	{ .name = "SoL", .address = "31.186.250.121", .port = "28070", .games = "ffa duel", .type = SV_Q3 },
@@ -55,38 +80,215 @@ const server_t serversArray[] = {
  */
 
 struct {
-	int conn;			// irc server socket file descriptor
-	char sbuf[SEND_BUF_SIZE + 1];	// send buffer; +1 for closing \0 when printing
-	char *cursor;
-	char *topic;
-	bool statusChanged;
-
-	pickupNode_t *pickupList;
-	playerNode_t *playerList;
-	player_t *self;
+	logBuffer_t log;
+	logBuffer_t traffic;		// binary traffic log
+	logBuffer_t trace;		// Chrome trace events
+	time_t logSecond;		// when logStamp was formatted
+	char logStamp[16];
+
+	int epoll;
+	event_t *readyList;		// events that are always ready
+	event_t signalEv;
+
+	network_t *networks;		// networksArray
+	int networkCount;
+	network_t *net;			// whose event is being handled
+
+	int resolveReq[2];		// resolver thread job queue
+	int resolveDone[2];		// resolver thread completion queue
+	bool resolverRunning;
+	event_t resolveEv;
+	evtimer_t resolveTimer;
+
+	server_t *servers;		// game servers, serversArray by default
+	int serverCount;
+	config_t config;		// pickups and servers in use
+	config_t retired;		// replaced ones, until their lookups finish
+	int q3sock;			// game server queries socket
+	event_t q3Ev;
+	evtimer_t queryTimer;		// announcements wait for servers until then
+	announcement_t *announcements;	// waiting for game servers to reply
+
+	dispatchTable_t ircDispatch;
+	dispatchTable_t botDispatch;
+
+	pool_t memberPool;
+
+	snapHeader_t *snap;		// mapped botSnapshotFile or NULL
+	size_t snapSize;
+	long long snapClock;		// wall clock minus com_milliseconds
+	bool snapDirty;			// some roster needs saving
+	bool snapServers;		// server status changed
+	char *snapBuf;			// roster area being put together
+	size_t snapBufLen;
+	size_t snapBufSize;
+
+	stats_t stats;
+	evtimer_t metricsTimer;
+#ifdef DEBUG_BENCHMARK
+	long long benchStart;
+#endif
 } bot;
 
 void announcePickup(pickup_t *pickup);
+void updatePickupStatus(pickup_t *pickup);
+void resolve(resolveJob_t *job);
+void processAnnouncements(void);
+void ircPump(void);
+void printHelp(const channel_t *channel, const char *to);
+void printStats(const char *to);
+channelMask_t channelBit(const channel_t *channel);
+void snap_saveTopic(const channel_t *channel);
+void snap_touchRoster(pickup_t *pickup);
+void snap_flush(void);
+bool reloadConfig(void);
+extern const botCommand_t botCommands[];
+
+/* Logging
+ * functions
+ */
+
+void log_write(logBuffer_t *buf)
+{
+	ssize_t len;
+	int	written = 0;
+
+	while (written < buf->len) {
+		len = write(buf->fd, buf->data + written, buf->len - written);
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;	// nowhere to report it
+		written += len;
+	}
+	buf->len = 0;
+}
+
+void log_flush(void)
+{
+	log_write(&bot.log);
+	if (bot.traffic.fd != -1)
+		log_write(&bot.traffic);
+	if (bot.trace.fd != -1)
+		log_write(&bot.trace);
+}
+
+void log_append(logBuffer_t *buf, const void *data, int len)
+{
+	if (buf->len + len > sizeof(buf->data))
+		log_write(buf);
+	if (len > sizeof(buf->data))
+		len = sizeof(buf->data);
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+// Current time as HH:MM:SS, formatted at most once per second
+const char *log_timestamp(time_t now)
+{
+	if (now != bot.logSecond) {
+		strftime(bot.logStamp, sizeof(bot.logStamp), "%H:%M:%S",
+			 localtime(&now));
+		bot.logSecond = now;
+	}
+	return bot.logStamp;
+}
+
+void log_vprintf(int level, const char *format, va_list ap)
+{
+	static const char * const levelNames[] = {
+		[LL_DEBUG]	= "debug: ",
+		[LL_INFO]	= "",
+		[LL_WARNING]	= "warning: ",
+		[LL_ERROR]	= "error: ",
+	};
+	char	line[MAX_LINE_LEN + 64];
+	int	len;
+
+	if (level < botLogLevel)
+		return;
+
+	len = snprintf(line, sizeof(line), "%s %s", log_timestamp(time(NULL)),
+		       levelNames[level]);
+	len += vsnprintf(line + len, sizeof(line) - len, format, ap);
+	if (len >= sizeof(line))
+		len = sizeof(line) - 1;
+	line[len++] = '\n';
+	log_append(&bot.log, line, len);
+
+	if (level >= LL_ERROR)
+		log_flush();
+}
+
+void log_printf(int level, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	log_vprintf(level, format, ap);
+	va_end(ap);
+}
+
+// Log a line received ('>') from or sent ('<') to the irc server
+void log_traffic(char dir, const char *line, int len)
+{
+#ifndef DEBUG_BENCHMARK
+	if (!botLogTraffic)
+		return;
+
+	if (bot.traffic.fd != -1) {
+		trafficRecord_t record = {
+			.time	= time(NULL),
+			.len	= len,
+			.dir	= dir,
+		};
+
+		log_append(&bot.traffic, &record, sizeof(record));
+		log_append(&bot.traffic, line, len);
+	} else {
+		log_printf(LL_INFO, "%c%c %.*s", dir, dir, len, line);
+	}
+#endif // !DEBUG_BENCHMARK
+}
+
+void initLog(void)
+{
+	const char *path = botTrafficFile;
+
+	bot.log.fd = STDOUT_FILENO;
+	bot.traffic.fd = -1;
+	if (path) {
+		bot.traffic.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (bot.traffic.fd == -1)
+			log_printf(LL_WARNING, "open %s: %s", path, strerror(errno));
+	}
+	atexit(log_flush);
+}
 
 void __attribute__ ((noreturn)) com_error(const char *format, ...)
 {
 	va_list ap;
 
+	int i;
+
 	va_start(ap, format);
-	vfprintf(stderr, format, ap);
+	log_vprintf(LL_ERROR, format, ap);
 	va_end(ap);
-	putc('\n', stderr);
 
 	assert(0);
-	close(bot.conn);
+	for (i = 0; i < bot.networkCount; i++)
+		close(bot.networks[i].conn);
 	exit(EXIT_FAILURE);
 }
 
 void __attribute__ ((noreturn)) com_perror(const char *s)
 {
-	perror(s);
+	int i;
+
+	log_printf(LL_ERROR, "%s: %s", s, strerror(errno));
 	assert(0);
-	close(bot.conn);
+	for (i = 0; i < bot.networkCount; i++)
+		close(bot.networks[i].conn);
 	exit(EXIT_FAILURE);
 }
 
@@ -95,9 +297,130 @@ void com_warning(const char *format, ...)
 	va_list ap;
 
 	va_start(ap, format);
-	vfprintf(stderr, format, ap);
+	log_vprintf(LL_WARNING, format, ap);
 	va_end(ap);
-	putc('\n', stderr);
+}
+
+// perror() through the log
+void com_pwarning(const char *s)
+{
+	log_printf(LL_WARNING, "%s: %s", s, strerror(errno));
+}
+
+long long com_milliseconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long com_nanoseconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Tracing
+ * functions
+ */
+
+enum trace_thread {
+	TT_IRC = 1,
+	TT_QUERIES
+};
+
+// Record a complete event, start and end in nanoseconds. Events are
+// appended to a JSON array which the trace viewers accept unclosed.
+void trace_span(int tid, const char *name, long long start, long long end)
+{
+	char	event[256];
+	char	escaped[64];
+	int	len = 0;
+
+	if (bot.trace.fd == -1)
+		return;
+
+	for (; *name && len < sizeof(escaped) - 2; name++) {
+		if (*name == '"' || *name == '\\')
+			escaped[len++] = '\\';
+		if ((unsigned char)*name >= ' ')
+			escaped[len++] = *name;
+	}
+	escaped[len] = '\0';
+
+	len = snprintf(event, sizeof(event),
+		       "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld.%03lld,"
+		       "\"dur\":%lld.%03lld,\"pid\":1,\"tid\":%d},\n",
+		       escaped, start / 1000, start % 1000,
+		       (end - start) / 1000, (end - start) % 1000, tid);
+	log_append(&bot.trace, event, len);
+}
+
+void initTrace(void)
+{
+	const char *path = botTraceFile;
+	const char *header =
+		"[\n"
+		"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+		"\"args\":{\"name\":\"irc\"}},\n"
+		"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,"
+		"\"args\":{\"name\":\"game server queries\"}},\n";
+
+	bot.trace.fd = -1;
+	if (!path)
+		return;
+
+	bot.trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (bot.trace.fd == -1) {
+		com_pwarning(path);
+		return;
+	}
+	log_append(&bot.trace, header, strlen(header));
+}
+
+/* Metrics
+ * functions
+ */
+
+void hist_add(histogram_t *hist, long long value)
+{
+	int i = 0;
+
+	if (value < 0)
+		value = 0;
+	if (value > 1)
+		i = 64 - __builtin_clzll(value - 1);
+	if (i >= HIST_BUCKETS)
+		i = HIST_BUCKETS - 1;
+
+	hist->buckets[i]++;
+	hist->count++;
+	hist->sum += value;
+}
+
+// Upper bound of the bucket holding the q-th quantile
+long long hist_quantile(const histogram_t *hist, double q)
+{
+	uint64_t rank = hist->count * q;
+	uint64_t seen = 0;
+	int i;
+
+	if (!hist->count)
+		return 0;
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += hist->buckets[i];
+		if (seen > rank)
+			break;
+	}
+	return 1LL << i;
+}
+
+long long hist_mean(const histogram_t *hist)
+{
+	return hist->count ? hist->sum / hist->count : 0;
 }
 
 void *com_malloc(size_t size)
@@ -108,6 +431,14 @@ void *com_malloc(size_t size)
 	return retval;
 }
 
+void *com_realloc(void *ptr, size_t size)
+{
+	void *retval = realloc(ptr, size);
+	if (!retval)
+		com_perror("realloc");
+	return retval;
+}
+
 char *com_strdup(const char *s)
 {
 	char *dup;
@@ -124,25 +455,6 @@ char *com_strdup(const char *s)
 	return dup;
 }
 
-ssize_t com_write(int fildes, const void *buf, size_t nbyte)
-{
-	ssize_t len;
-	size_t written = 0;
-
-	while (written < nbyte) {
-		len = write(fildes, (char *)buf + written, nbyte - written);
-		written += len;
-
-		if (len == -1) {
-			perror("com_write");
-			break;
-		}
-		if (len == 0)
-			break;
-	}
-	return written;
-}
-
 /* IRC protocol-specific
  * functions
  */
@@ -203,6 +515,18 @@ int irc_strcasecmp(const char *s1, const char *s2)
 	return *s2;
 }
 
+// FNV-1a hash of casemapped nick
+unsigned irc_hashNick(const char *nick)
+{
+	unsigned hash = 2166136261u;
+
+	while (*nick) {
+		hash ^= (unsigned char)irc_tolower(*nick++);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 bool irc_validateNick(const char *nick)
 {
 	int i;
@@ -230,31 +554,127 @@ bool irc_validateNick(const char *nick)
 /* Buffered IRC server output
  * functions
  */
+
+// Append len bytes to the send queue, growing it up to botMaxSendQueue
+bool sq_push(sendQueue_t *sq, const char *buf, int len)
+{
+	int queued = sq->tail - sq->head;
+	int size;
+
+	if (sq->tail + len <= sq->size) {
+		memcpy(sq->data + sq->tail, buf, len);
+		sq->tail += len;
+		return true;
+	}
+
+	if (queued + len > botMaxSendQueue)
+		return false;
+
+	if (sq->head) {
+		memmove(sq->data, sq->data + sq->head, queued);
+		sq->head = 0;
+		sq->tail = queued;
+	}
+
+	if (queued + len > sq->size) {
+		size = sq->size ? sq->size : SEND_BUF_SIZE;
+		while (size < queued + len)
+			size *= 2;
+		sq->data = com_realloc(sq->data, size);
+		sq->size = size;
+	}
+
+	memcpy(sq->data + sq->tail, buf, len);
+	sq->tail += len;
+	return true;
+}
+
+// Write as much as fd takes without blocking. Returns false on error.
+bool sq_send(sendQueue_t *sq, int fd)
+{
+	ssize_t len;
+
+	while (sq->head < sq->tail) {
+		len = write(fd, sq->data + sq->head, sq->tail - sq->head);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			com_pwarning("sq_send: write");
+			return false;
+		}
+		sq->head += len;
+	}
+
+	if (sq->head == sq->tail)
+		sq->head = sq->tail = 0;
+	return true;
+}
+
+void sq_clear(sendQueue_t *sq)
+{
+	sq->head = sq->tail = 0;
+}
+
+int bot_lineClass(const char *line)
+{
+	if (!strncmp(line, "TOPIC ", 6))
+		return OUT_TOPIC;
+	if (!strncmp(line, "PRIVMSG ", 8) || !strncmp(line, "NOTICE ", 7))
+		return OUT_NORMAL;
+	return OUT_URGENT;
+}
+
+// Hand complete lines over to the output scheduler. An unfinished
+// line stays in the buffer unless it fills all of it.
 int bot_flush(void)
 {
-	time_t epochTime;
-	struct tm *locTime;
+	char	*line = bot.net->sbuf;
+	char	*end;
+	long long start;
+	int	outClass;
+	int	retVal = 0;
 
-	if (bot.cursor == bot.sbuf)
+	if (bot.net->cursor == bot.net->sbuf)
 		return 0;
 
-	time(&epochTime);
-	locTime = localtime(&epochTime);
-	*bot.cursor = '\0';
-	printf("%02d:%02d << %s", locTime->tm_hour, locTime->tm_min, bot.sbuf);
+	start = com_nanoseconds();
+	while ((end = memchr(line, '\n', bot.net->cursor - line))) {
+		outClass = bot.net->outClass;
+		if (outClass == OUT_AUTO)
+			outClass = bot_lineClass(line);
 
-#ifndef DEBUG_INTERCEPT
-	size_t writeLen = bot.cursor - bot.sbuf;
-	size_t len;
+		if (sq_push(&bot.net->outq[outClass], line, end + 1 - line)) {
+			hist_add(&bot.stats.queueDepth, bot.net->outLines++);
+		} else {
+			com_warning("bot_flush: Send queue full, dropping %.*s",
+				    (int)(end - line), line);
+			bot.stats.outputDropped++;
+			retVal = EOF;
+		}
+		line = end + 1;
+	}
 
-	len = com_write(bot.conn, bot.sbuf, writeLen);
-	if (len < writeLen) {
-		com_warning("bot_flush: Sent only %zd bytes out of %zd", len, writeLen);
-		return EOF;
+	if (line == bot.net->sbuf && bot.net->cursor == bot.net->sbuf + SEND_BUF_SIZE) {
+		com_warning("bot_flush: Dropping unterminated line");
+		bot.stats.outputDropped++;
+		line = bot.net->cursor;
+		retVal = EOF;
 	}
-#endif
-	bot.cursor = bot.sbuf;
-	return 0;
+
+	memmove(bot.net->sbuf, line, bot.net->cursor - line);
+	bot.net->cursor = bot.net->sbuf + (bot.net->cursor - line);
+	ircPump();
+	trace_span(TT_IRC, "flush", start, com_nanoseconds());
+	return retVal;
+}
+
+// Following lines go out with outClass priority or OUT_AUTO
+void bot_setOutClass(int outClass)
+{
+	bot_flush();
+	bot.net->outClass = outClass;
 }
 
 int bot_puts(const char *s)
@@ -264,14 +684,14 @@ int bot_puts(const char *s)
 	if (len + 2 > SEND_BUF_SIZE)
 		return EOF;
 
-	if (bot.sbuf + SEND_BUF_SIZE <= bot.cursor + len + 2)
-		if (bot_flush())
+	if (bot.net->sbuf + SEND_BUF_SIZE < bot.net->cursor + len + 2)
+		if (bot_flush() || bot.net->sbuf + SEND_BUF_SIZE < bot.net->cursor + len + 2)
 			return EOF;
 
-	memcpy(bot.cursor, s, len);
-	bot.cursor += len;
-	*bot.cursor++ = '\r';
-	*bot.cursor++ = '\n';
+	memcpy(bot.net->cursor, s, len);
+	bot.net->cursor += len;
+	*bot.net->cursor++ = '\r';
+	*bot.net->cursor++ = '\n';
 	return len + 2;
 }
 
@@ -279,11 +699,11 @@ int bot_putchar(int c)
 {
 	unsigned char ch = c;
 
-	if (bot.cursor >= bot.sbuf + SEND_BUF_SIZE)
+	if (bot.net->cursor >= bot.net->sbuf + SEND_BUF_SIZE)
 		if (bot_flush())
 			return EOF;
 
-	*bot.cursor++ = ch;
+	*bot.net->cursor++ = ch;
 	return ch;
 }
 
@@ -302,985 +722,4080 @@ int bot_printf(const char *format, ...)
 	if (len >= sizeof(buf))
 		return -1;
 
-	if (bot.cursor + len > bot.sbuf + SEND_BUF_SIZE)
-		if (bot_flush())
+	if (bot.net->cursor + len > bot.net->sbuf + SEND_BUF_SIZE)
+		if (bot_flush() || bot.net->cursor + len > bot.net->sbuf + SEND_BUF_SIZE)
 			return -1;
 
-	memcpy(bot.cursor, buf, len);
-	bot.cursor += len;
+	memcpy(bot.net->cursor, buf, len);
+	bot.net->cursor += len;
 	return len;
 }
 
-void sigHandler(int signum)
+/* Slab allocator
+ * functions
+ */
+
+void pool_init(pool_t *pool, size_t objSize, int slabObjs, int maxObjs)
 {
-	bot_printf("QUIT :SIGINT\r\n");
-	close(bot.conn);
-	exit(EXIT_SUCCESS);
+	memset(pool, 0, sizeof(*pool));
+	if (objSize < sizeof(void *))
+		objSize = sizeof(void *);
+	pool->objSize = (objSize + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	pool->slabObjs = slabObjs;
+	pool->maxObjs = maxObjs;
 }
 
-int getQ3ServerInfo(const server_t *server, q3serverInfo_t *info)
+// Returns NULL if pool reached maxObjs
+void *pool_alloc(pool_t *pool)
 {
-	char svbuf[MAX_Q3_INFO_LEN + 1];
-	struct addrinfo hints;
-	struct addrinfo *res;
-	struct timeval timeout;
-	const char *getinfo = "\xFF\xFF\xFF\xFF\x02getinfo\x0a\x00";
-	char	*ptr;
-	fd_set	set;
-	int	readlen;
-	int	sv_sock;
-
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_DGRAM;
-	if (getaddrinfo(server->address, server->port, &hints, &res))
-		return 0;
-	sv_sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	if (sv_sock == -1)
-		return -1;
-
-	sendto(sv_sock, getinfo, strlen(getinfo) + 1, 0, res->ai_addr, res->ai_addrlen);
-	freeaddrinfo(res);
-
-	bot_flush(); // Make sure we don't hold split messages
-
-	FD_ZERO(&set);
-	FD_SET(sv_sock, &set);
-	timeout.tv_sec = 1;
-	timeout.tv_usec = 0;
-	if (select(sv_sock + 1, &set, NULL, NULL, &timeout) != 1) {
-		close(sv_sock);
-		return 0;
+	void *obj;
+
+	if (!pool->freeList) {
+		slab_t *slab;
+		char *ptr;
+		int n = pool->slabObjs;
+		int i;
+
+		if (pool->maxObjs && pool->objs + n > pool->maxObjs)
+			n = pool->maxObjs - pool->objs;
+		if (n <= 0)
+			return NULL;
+
+		slab = com_malloc(POOL_ALIGN + n * pool->objSize);
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		pool->objs += n;
+
+		ptr = (char *)slab + POOL_ALIGN;
+		for (i = 0; i < n; i++) {
+			*(void **)ptr = pool->freeList;
+			pool->freeList = ptr;
+			ptr += pool->objSize;
+		}
 	}
 
-	readlen = read(sv_sock, svbuf, MAX_Q3_INFO_LEN);
-	close(sv_sock);
-	if (readlen == -1)
-		return -1;
+	obj = pool->freeList;
+	pool->freeList = *(void **)obj;
+	pool->used++;
+	return obj;
+}
 
-	svbuf[readlen] = '\0';
-	ptr = strtok(svbuf, "\\");
-	info->maxclients = 0;
-	info->clients = 0;
-	do {
-		if (!strcasecmp(ptr, "sv_maxclients"))
-			info->maxclients += atoi(strtok(NULL, "\\"));
-		else if (!strcasecmp(ptr, "sv_privateclients"))
-			info->maxclients -= atoi(strtok(NULL, "\\"));
-		else if (!strcasecmp(ptr, "clients"))
-			info->clients = atoi(strtok(NULL, "\\"));
+void pool_free(pool_t *pool, void *obj)
+{
+	*(void **)obj = pool->freeList;
+	pool->freeList = obj;
+	pool->used--;
+}
 
-		ptr = strtok(NULL, "\\");
-	} while (ptr);
+// Release all slabs. Pool must not have any objects in use.
+void pool_destroy(pool_t *pool)
+{
+	assert(!pool->used);
 
-	if (info->maxclients)
-		return 1;
-	else
-		return 0;
-}
+	while (pool->slabs) {
+		slab_t *slab = pool->slabs;
 
+		pool->slabs = slab->next;
+		free(slab);
+	}
+	pool->freeList = NULL;
+	pool->objs = 0;
+}
 
-/* List manipulation
+/* Event loop
  * functions
  */
 
-pickupNode_t *pushPickup(pickupNode_t *node, pickup_t *pickup)
+void ev_init(void)
 {
-	pickupNode_t *pickupNode = com_malloc(sizeof(pickupNode_t));
-	pickupNode->pickup = pickup;
-	pickupNode->next = node;
-	return pickupNode;
+	bot.epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (bot.epoll == -1)
+		com_perror("epoll_create1");
 }
 
-pickupNode_t *popPickup(pickupNode_t *node)
+bool ev_add(event_t *ev, uint32_t events)
 {
-	if (node) {
-		pickupNode_t *retval = node->next;
-		free(node);
-		return retval;
+	struct epoll_event event = {
+		.events		= events,
+		.data.ptr	= ev,
+	};
+
+	if (!epoll_ctl(bot.epoll, EPOLL_CTL_ADD, ev->fd, &event))
+		return true;
+
+	if (errno == EPERM) {
+		ev->alwaysReady = true;
+		ev->nextReady = bot.readyList;
+		bot.readyList = ev;
+		return true;
 	}
-	return NULL;
+
+	com_pwarning("ev_add: epoll_ctl");
+	return false;
 }
 
-pickupNode_t *freePickupList(pickupNode_t *node)
+void ev_modify(event_t *ev, uint32_t events)
 {
-	if (!node)
-		return NULL;
-	else
-		return freePickupList(popPickup(node));
+	struct epoll_event event = {
+		.events		= events,
+		.data.ptr	= ev,
+	};
+
+	if (!ev->alwaysReady && epoll_ctl(bot.epoll, EPOLL_CTL_MOD, ev->fd, &event))
+		com_pwarning("ev_modify: epoll_ctl");
 }
 
-playerNode_t *popPlayer(playerNode_t *node)
+void ev_del(event_t *ev)
 {
-	if (node) {
-		playerNode_t *retval = node->next;
-		free(node);
-		return retval;
+	event_t **node;
+
+	if (!ev->alwaysReady) {
+		epoll_ctl(bot.epoll, EPOLL_CTL_DEL, ev->fd, NULL);
+		return;
 	}
-	return NULL;
+
+	for (node = &bot.readyList; *node; node = &(*node)->nextReady) {
+		if (*node == ev) {
+			*node = ev->nextReady;
+			break;
+		}
+	}
+	ev->alwaysReady = false;
 }
 
-player_t *registerPlayer(const char *nick, bool op)
+// Wait for events at most timeout milliseconds or forever if it's -1
+// and run their callbacks. Callbacks are not run for events whose fd
+// was set to -1 by an earlier callback.
+void ev_dispatch(int timeout)
 {
-	playerNode_t *playerNode;
-	player_t *player;
+	struct epoll_event events[EV_MAX_EVENTS];
+	event_t *ev;
+	event_t *next;
+	int	n;
+	int	i;
+
+	if (bot.readyList)
+		timeout = 0;
+
+	n = epoll_wait(bot.epoll, events, EV_MAX_EVENTS, timeout);
+	if (n == -1) {
+		if (errno != EINTR)
+			com_pwarning("epoll_wait");
+		return;
+	}
 
-	assert(irc_validateNick(nick));
+	for (i = 0; i < n; i++) {
+		ev = events[i].data.ptr;
+		if (ev->fd != -1)
+			ev->callback(ev, events[i].events);
+	}
 
-	playerNode = com_malloc(sizeof(playerNode_t));
-	player = com_malloc(sizeof(player_t));
-	player->nick = com_malloc(strlen(nick) + 1);
-	strcpy(player->nick, nick);
-	player->op = op;
-	playerNode->player = player;
-	playerNode->next = bot.playerList;
-	bot.playerList = playerNode;
+	for (ev = bot.readyList; ev; ev = next) {
+		next = ev->nextReady;
+		ev->callback(ev, EPOLLIN);
+	}
+}
 
-	if (!bot.self && !strcmp(nick, botNick))
-		bot.self = player;
+void ev_timerCallback(event_t *ev, uint32_t events)
+{
+	evtimer_t *timer = ev->ctx;
+	uint64_t expirations;
 
-	return player;
+	if (read(ev->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		timer->callback(timer);
 }
 
-playerNode_t *pushPlayer(playerNode_t *node, player_t *player)
+void ev_timerInit(evtimer_t *timer, void (*callback)(evtimer_t *timer))
 {
-	playerNode_t *playerNode = com_malloc(sizeof(playerNode_t));
-	playerNode->player = player;
-	playerNode->next = node;
-	return playerNode;
+	timer->ev.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer->ev.fd == -1)
+		com_perror("timerfd_create");
+
+	timer->ev.callback = ev_timerCallback;
+	timer->ev.ctx = timer;
+	timer->callback = callback;
+	ev_add(&timer->ev, EPOLLIN);
 }
 
-serverNode_t *pushServer(serverNode_t *node, const server_t *server)
+// Fire timer after delay milliseconds and then every interval
+// milliseconds if it's not 0. Zero delay stops the timer.
+void ev_timerSet(evtimer_t *timer, long long delay, long long interval)
 {
-	serverNode_t *serverNode = com_malloc(sizeof(serverNode_t));
-	serverNode->server = server;
-	serverNode->next = node;
-	return serverNode;
+	struct itimerspec its = {
+		.it_value.tv_sec	= delay / 1000,
+		.it_value.tv_nsec	= delay % 1000 * 1000000,
+		.it_interval.tv_sec	= interval / 1000,
+		.it_interval.tv_nsec	= interval % 1000 * 1000000,
+	};
+
+	if (timerfd_settime(timer->ev.fd, 0, &its, NULL))
+		com_pwarning("ev_timerSet: timerfd_settime");
 }
 
-void addServer(pickupNode_t *node, const server_t *server)
+void signalCallback(event_t *ev, uint32_t events)
 {
-	if (node) {
-		node->pickup->serverList = pushServer(node->pickup->serverList, server);
-		addServer(node->next, server);
-	}
-}
+	struct signalfd_siginfo info;
+	int i;
+	int j;
 
-/* cutPlayer
- * move player to the top of a list or return null
- */
+	if (read(ev->fd, &info, sizeof(info)) != sizeof(info))
+		return;
 
-playerNode_t *cutPlayerH(playerNode_t *node, const player_t *player)
-{
-	if (!node->next) {
-		return NULL;
-	} else {
-		if (node->next->player == player) {
-			playerNode_t *playerNode = node->next;
-			node->next = node->next->next;
-			return playerNode;
-		} else {
-			return cutPlayerH(node->next, player);
-		}
+	if (info.ssi_signo == SIGHUP) {
+		reloadConfig();
+		return;
 	}
-}
-
-playerNode_t *cutPlayer(playerNode_t *node, const player_t *player)
-{
-	if (node) {
-		if (node->player == player)
-			return node;
 
-		playerNode_t *playerNode = cutPlayerH(node, player);
-		if (playerNode)
-			playerNode->next = node;
-		return playerNode;
+	for (i = 0; i < bot.networkCount; i++) {
+		bot.net = &bot.networks[i];
+		if (bot.net->state < NET_REGISTERING)
+			continue;
+
+		// Let the queue drain before we go
+		fcntl(bot.net->conn, F_SETFL, fcntl(bot.net->conn, F_GETFL) & ~O_NONBLOCK);
+		// but don't wait for flood control
+		for (j = 0; j < OUT_CLASSES; j++)
+			sq_clear(&bot.net->outq[j]);
+		bot.net->outLines = 0;
+		bot.net->floodClock = 0;
+		bot_printf("QUIT :%s\r\n", info.ssi_signo == SIGTERM ?
+			   "SIGTERM" : "SIGINT");
+		bot_flush();
+		close(bot.net->conn);
 	}
-	return NULL;
+	snap_flush();
+	exit(EXIT_SUCCESS);
 }
 
-player_t *findNickH(playerNode_t *node, const char *nick)
+void initSignals(void)
 {
-	if (!node)
-		return NULL;
-	else if (!strcmp(node->player->nick, nick))
-		return node->player;
-	else
-		return findNickH(node->next, nick);
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL))
+		com_perror("sigprocmask");
+
+	bot.signalEv.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (bot.signalEv.fd == -1)
+		com_perror("signalfd");
+	bot.signalEv.callback = signalCallback;
+	ev_add(&bot.signalEv, EPOLLIN);
 }
 
-player_t *findNick(const char *nick)
+/* Asynchronous name resolution
+ * functions
+ */
+
+void resolveJobRun(resolveJob_t *job)
 {
-	assert(irc_validateNick(nick));
+	struct addrinfo hints;
+	struct addrinfo *res;
 
-	return findNickH(bot.playerList, nick);
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = job->socktype;
+	job->error = getaddrinfo(job->host, job->port, &hints, &res);
+	if (!job->error) {
+		memcpy(&job->result, res->ai_addr, sizeof(job->result));
+		freeaddrinfo(res);
+	}
 }
 
-int countPlayers(const playerNode_t *node)
+void *resolverThread(void *arg)
 {
-	if (!node)
-		return 0;
-	else
-		return countPlayers(node->next) + 1;
-}
+	resolveJob_t *job;
 
-void removePlayer(pickupNode_t *node, const player_t *player)
-{
-	if (node) {
-		playerNode_t *playerNode = cutPlayer(node->pickup->playerList, player);
-		if (playerNode) {
-			node->pickup->playerList = popPlayer(playerNode);
-			node->pickup->count--;
-			bot.statusChanged = true;
-		}
-		removePlayer(node->next, player);
+	while (read(bot.resolveReq[0], &job, sizeof(job)) == sizeof(job)) {
+		resolveJobRun(job);
+		if (write(bot.resolveDone[1], &job, sizeof(job)) != sizeof(job))
+			break;
 	}
+	return NULL;
 }
 
-void removePickupPlayers(pickup_t *pickup)
+void resolveJobDone(resolveJob_t *job)
 {
-	if (pickup->playerList) {
-		removePlayer(bot.pickupList, pickup->playerList->player);
-		removePickupPlayers(pickup);
+	job->busy = false;
+	job->updated = com_milliseconds();
+
+	// Keep the old address if lookup failed
+	if (job->error) {
+		com_warning("getaddrinfo %s: %s", job->host, gai_strerror(job->error));
+	} else {
+		job->addr = job->result;
+		job->resolved = true;
 	}
+
+	if (job->done)
+		job->done(job);
 }
 
-void removeNick(pickupNode_t *node, const char *nick)
+// Start looking up job's address unless it's in progress already.
+// Falls back to blocking lookup if there is no resolver thread.
+void resolve(resolveJob_t *job)
 {
-	player_t *player = findNick(nick);
-	if (player) {
-		removePlayer(node, player);
-	}
+	if (job->busy)
+		return;
+
+	job->busy = true;
+	if (bot.resolverRunning &&
+	    write(bot.resolveReq[1], &job, sizeof(job)) == sizeof(job))
+		return;
+
+	resolveJobRun(job);
+	resolveJobDone(job);
 }
 
-void forgetPlayer(player_t *player)
+// Process lookups completed by the resolver thread
+void receiveResolved(void)
 {
-	removePlayer(bot.pickupList, player);
-	bot.playerList = popPlayer(cutPlayer(bot.playerList, player));
-	free(player->nick);
-	free(player);
+	resolveJob_t *job;
+
+	while (read(bot.resolveDone[0], &job, sizeof(job)) == sizeof(job))
+		resolveJobDone(job);
 }
 
-void forgetPlayers(playerNode_t *node)
+void resolveCallback(event_t *ev, uint32_t events)
 {
-	if (node) {
-		playerNode_t *playerNode = node->next;
-		forgetPlayer(node->player);
-		forgetPlayers(playerNode);
-	}
+	receiveResolved();
 }
 
-void forgetNick(const char *nick)
+// Look up all known addresses again
+void resolveTimerCallback(evtimer_t *timer)
 {
-	player_t *player = findNick(nick);
-	if (player)
-		forgetPlayer(player);
+	int i;
+
+	for (i = 0; i < bot.networkCount; i++)
+		resolve(&bot.networks[i].resolve);
+	for (i = 0; i < bot.serverCount; i++)
+		resolve(&bot.servers[i].resolve);
 }
 
-void addPlayer(pickupNode_t *node, player_t *player)
+// Must be called after initSignals. The resolver thread inherits the
+// signal mask, so signals stay blocked there and only reach signalfd.
+void initResolver(void)
 {
-	if (node) {
-		playerNode_t *playerNode = cutPlayer(node->pickup->playerList, player);
-		if (playerNode) {
-			node->pickup->playerList = playerNode;
-		} else {
-			node->pickup->playerList = pushPlayer(node->pickup->playerList, player);
-			node->pickup->count++;
-			bot.statusChanged = true;
-			if (node->pickup->max && node->pickup->count == node->pickup->max) {
-				announcePickup(node->pickup);
-				removePickupPlayers(node->pickup);
-				return;
-			}
-		}
-		addPlayer(node->next, player);
+	pthread_t thread;
+
+	ev_timerInit(&bot.resolveTimer, resolveTimerCallback);
+	ev_timerSet(&bot.resolveTimer, botResolveInterval * 1000LL,
+		    botResolveInterval * 1000LL);
+
+	if (pipe(bot.resolveReq) || pipe(bot.resolveDone)) {
+		com_pwarning("initResolver: pipe");
+		return;
 	}
-}
+	fcntl(bot.resolveDone[0], F_SETFL, O_NONBLOCK);
 
-void addNick(pickupNode_t *node, const char *nick)
-{
-	player_t *player = findNick(nick);
-	if (!player && node) {
-		player = registerPlayer(nick, false);
-		com_warning("addNick: Player %s was not registered", nick);
+	if (pthread_create(&thread, NULL, resolverThread, NULL)) {
+		com_warning("initResolver: Couldn't start resolver thread");
+		return;
 	}
+	pthread_detach(thread);
+	bot.resolverRunning = true;
 
-	addPlayer(node, player);
+	bot.resolveEv.fd = bot.resolveDone[0];
+	bot.resolveEv.callback = resolveCallback;
+	ev_add(&bot.resolveEv, EPOLLIN);
 }
 
-void changeNick(const char *nick, const char *newnick)
-{
-	player_t *player = findNick(nick);
-	if (player) {
-		free(player->nick);
-		player->nick = com_malloc(strlen(newnick) + 1);
-		strcpy(player->nick, newnick);
-	}
-}
+/* Quake 3 server queries
+ * functions
+ */
 
-void printPlayers(const playerNode_t *node, const char *sep, bool op)
+int nextQ3InfoInt(char **saveptr)
 {
-	if (node) {
-		const char *opMark = "";
+	char *value = strtok_r(NULL, "\\", saveptr);
 
-		if (!node->next)
-			sep = "";
-		if (op && node->player->op)
-			opMark = "@";
-		bot_printf("%s%s%s", opMark, node->player->nick, sep);
-		printPlayers(node->next, sep, op);
-	}
+	return value ? atoi(value) : 0;
 }
 
-void printPickups(const pickupNode_t *node)
+// Parses infoResponse packet. Returns true if it advertised any
+// player slots.
+bool parseQ3ServerInfo(char *svbuf, q3serverInfo_t *info)
 {
-	if (node) {
-		const char *formatString;
+	char *ptr;
+	char *saveptr;
 
-		if (botPrintEmpty || node->pickup->count) {
-			if (node->pickup->max) {
-				formatString = node->pickup->count ?
-					"\x02(\x02 %s %d/%d \x02)\x02" :
-					"( %s %d/%d )";
-				bot_printf(formatString, node->pickup->name,
-					   node->pickup->count, node->pickup->max);
-			} else {
-				formatString = node->pickup->count ?
-					"\x02(\x02 %s %d \x02)\x02" :
-					"( %s %d )";
-				bot_printf(formatString, node->pickup->name,
-					   node->pickup->count);
-			}
-		}
-		printPickups(node->next);
-	}
-}
+	info->maxclients = 0;
+	info->clients = 0;
 
-void printServers(const serverNode_t *node)
-{
-	q3serverInfo_t q3serverInfo;
+	ptr = strtok_r(svbuf, "\\", &saveptr);
+	while (ptr) {
+		if (!strcasecmp(ptr, "sv_maxclients"))
+			info->maxclients += nextQ3InfoInt(&saveptr);
+		else if (!strcasecmp(ptr, "sv_privateclients"))
+			info->maxclients -= nextQ3InfoInt(&saveptr);
+		else if (!strcasecmp(ptr, "clients"))
+			info->clients = nextQ3InfoInt(&saveptr);
 
-	if (node) {
-		int retVal = 0;
-
-		if (node->server->type == SV_Q3)
-			retVal = getQ3ServerInfo(node->server, &q3serverInfo);
-
-		if (retVal == 1) {
-			bot_printf("\x02(\x02 %s %d/%d %s:%s \x02)\x02",
-				   node->server->name, q3serverInfo.clients,
-				   q3serverInfo.maxclients, node->server->address,
-				   node->server->port);
-		} else if (retVal == -1) {
-			bot_printf("\x02(\x02 %s %s:%s \x02)\x02",
-				   node->server->name, node->server->address,
-				   node->server->port);
-		}
-		printServers(node->next);
+		ptr = strtok_r(NULL, "\\", &saveptr);
 	}
+
+	return info->maxclients != 0;
 }
 
-void setTopic(const char *newTopic)
+server_t *findServerByAddr(const struct sockaddr_in *addr)
 {
-	if (!newTopic)
-		return;
+	int i;
 
-	if (bot.topic)
-		free(bot.topic);
+	for (i = 0; i < bot.serverCount; i++) {
+		server_t *server = &bot.servers[i];
 
-	bot.topic = com_strdup(newTopic);
+		if (server->queryDeadline &&
+		    server->resolve.addr.sin_port == addr->sin_port &&
+		    server->resolve.addr.sin_addr.s_addr == addr->sin_addr.s_addr)
+			return server;
+	}
+	return NULL;
 }
 
-void updateStatus()
+void setServerStatus(server_t *server, enum sv_status status, long long now)
 {
-	bot_printf("TOPIC %s :", botChannel);
-	printPickups(bot.pickupList);
-	bot_printf("\x02(\x02 %s \x02)(\x02 Type !help \x02)\x02\r\n", bot.topic);
-	bot.statusChanged = false;
+	server->status = status;
+	server->updated = now;
+	if (bot.snap)
+		bot.snapServers = true;
 }
 
-void announceServers(const pickupNode_t *node, const char *to)
+// Send getinfo to a server unless there is a query in flight
+// already. Replies are collected by receiveQ3Info.
+void sendQ3Query(server_t *server, long long now)
 {
-	if (node) {
-		if (node->pickup->serverList) {
-			bot_printf("PRIVMSG %s :Recommended %s servers: ",
-				   to, node->pickup->name);
-			printServers(node->pickup->serverList);
-			bot_printf("\r\n");
-		}
+	if (server->queryDeadline)
+		return;
+#ifdef DEBUG_BENCHMARK
+	// Every server replies at once
+	server->info.clients = 0;
+	server->info.maxclients = 16;
+	setServerStatus(server, SV_UP, now);
+#else
+	const char *getinfo = "\xFF\xFF\xFF\xFF\x02getinfo\x0a\x00";
 
-		announceServers(node->next, to);
+	if (!server->resolve.resolved) {
+		// Query will be sent once the address is known
+		resolve(&server->resolve);
+		return;
 	}
+	if (sendto(bot.q3sock, getinfo, strlen(getinfo) + 1, 0,
+		   (struct sockaddr *)&server->resolve.addr,
+		   sizeof(server->resolve.addr)) == -1) {
+		setServerStatus(server, SV_ERROR, now);
+		return;
+	}
+	server->queryDeadline = now + botQueryTimeout;
+	bot.stats.queriesSent++;
+#endif // !DEBUG_BENCHMARK
 }
 
-void announcePickup(pickup_t *pickup)
+void serverResolved(resolveJob_t *job)
 {
-	pickupNode_t *node;
+	server_t *server = job->ctx;
 
-	bot_printf("PRIVMSG ");
-	printPlayers(pickup->playerList, ",", false);
-	bot_printf(",%s :\x02%s pickup is ready to start!\x02 Players are: ",
-		   botChannel, pickup->name);
-	printPlayers(pickup->playerList, ", ", false);
-	bot_printf("\r\n");
-
-	node = pushPickup(NULL, pickup);
-	announceServers(node, botChannel);
-	popPickup(node);
+	if (!job->resolved) {
+		setServerStatus(server, SV_DOWN, job->updated);
+	} else if (server->status == SV_UNKNOWN) {
+		sendQ3Query(server, job->updated);
+	}
 }
 
-void announcePlayers(const pickupNode_t *node, const char *to)
+void expireQ3Query(server_t *server, long long now)
 {
-	if (node) {
-		if (node->pickup->count) {
-			if (node->pickup->max) {
-				bot_printf("PRIVMSG %s :\x02(\x02 %s %d/%d \x02)\x02 Players are: ",
-					   to, node->pickup->name,
-					   node->pickup->count, node->pickup->max);
-			} else {
-				bot_printf("PRIVMSG %s :\x02(\x02 %s %d \x02)\x02 Players are: ",
-					   to, node->pickup->name,
-					   node->pickup->count);
-			}
-
-			printPlayers(node->pickup->playerList, ", ", false);
-			bot_printf("\r\n");
-		}
-		announcePlayers(node->next, to);
+	if (server->queryDeadline && server->queryDeadline <= now) {
+		server->queryDeadline = 0;
+		bot.stats.queryTimeouts++;
+		setServerStatus(server, SV_DOWN, now);
 	}
 }
 
-void promotePickup(const pickupNode_t *node)
+// Read all replies waiting on bot.q3sock
+void receiveQ3Info(void)
 {
-	const char *pluralSuffix;
-	const char *pluralSuffixLeft;
-	const char *beForm;
-	pickupNode_t *pickupNode;
+	char svbuf[MAX_Q3_INFO_LEN + 1];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	server_t *server;
+	int	readlen;
 
-	if (node) {
-		if (node->pickup->count == 1) {
-			pluralSuffix = "";
-			beForm = "is";
-		} else {
-			pluralSuffix = "s";
-			beForm = "are";
+	while (true) {
+		fromlen = sizeof(from);
+		readlen = recvfrom(bot.q3sock, svbuf, MAX_Q3_INFO_LEN, MSG_DONTWAIT,
+				   (struct sockaddr *)&from, &fromlen);
+		if (readlen == -1)
+			return;
+
+		server = findServerByAddr(&from);
+		if (!server)
+			continue;
+
+		svbuf[readlen] = '\0';
+		setServerStatus(server, parseQ3ServerInfo(svbuf, &server->info) ?
+				SV_UP : SV_DOWN, com_milliseconds());
+		if (server->queryDeadline) {
+			// Sent botQueryTimeout before the deadline
+			long long sent = server->queryDeadline - botQueryTimeout;
+
+			hist_add(&bot.stats.queryRtt, server->updated - sent);
+			trace_span(TT_QUERIES, server->name, sent * 1000000,
+				   com_nanoseconds());
+			bot.stats.queryReplies++;
 		}
-		if (node->pickup->max - node->pickup->count == 1)
-			pluralSuffixLeft = "";
-		else
-			pluralSuffixLeft = "s";
+		server->queryDeadline = 0;
+	}
+}
 
-		if (node->pickup->max && node->pickup->count) {
-			bot_printf("PRIVMSG %s :\x02Only %d player%s needed for %s game!\x02 Type !add %s to sign up.\r\n",
-			    botChannel, node->pickup->max - node->pickup->count,
-			    pluralSuffixLeft, node->pickup->name, node->pickup->name);
-		} else if (node->pickup->count == 1 && !botSilentWho) {
-			bot_printf("PRIVMSG %s :\x02Wanna play %s? %s is waiting!\x02 Type !add %s\r\n",
-			    botChannel, node->pickup->name,
-			    node->pickup->playerList->player->nick, node->pickup->name);
-		} else if (node->pickup->count) {
-			bot_printf("PRIVMSG %s :\x02Wanna play %s? There %s %d player%s waiting!\x02 Type !add %s\r\n",
-			    botChannel, node->pickup->name, beForm, node->pickup->count,
-			    pluralSuffix, node->pickup->name);
+// Cached status is good enough to be printed, maybe after a refresh
+bool serverUsable(const server_t *server, long long now)
+{
+	return server->status != SV_UNKNOWN &&
+		now - server->updated < botServerMaxAge * 1000LL;
+}
 
-			if (!botSilentWho) {
-				pickupNode = pushPickup(NULL, node->pickup);
-				announcePlayers(pickupNode, botChannel);
-				popPickup(pickupNode);
-			}
+// Refresh status of q3 servers recommended for pickups on the list if
+// it's older than botServerTTL. Returns number of servers we have to
+// wait for because their status is unknown or too old to be printed,
+// whether they were sent a query or their address is being looked up.
+int refreshServers(const pickupNode_t *node, long long now)
+{
+	const serverNode_t *serverNode;
+	int waiting = 0;
+
+	for (; node; node = node->next) {
+		for (serverNode = node->pickup->serverList; serverNode;
+		     serverNode = serverNode->next) {
+			server_t *server = serverNode->server;
+
+			if (server->type != SV_Q3)
+				continue;
+
+			expireQ3Query(server, now);
+			if (server->status != SV_UNKNOWN &&
+			    now - server->updated < botServerTTL * 1000LL)
+				continue;
+
+			sendQ3Query(server, now);
+			if ((server->queryDeadline || server->resolve.busy) &&
+			    !serverUsable(server, now))
+				waiting++;
 		}
-		promotePickup(node->next);
 	}
+	return waiting;
 }
 
-void printHelp(const char *to)
+void q3Callback(event_t *ev, uint32_t events)
 {
-	bot_printf("PRIVMSG %s :You can type commands in the main channel or query the bot.\r\n", to);
-	bot_printf("PRIVMSG %s :!help, !version - print info messages\r\n", to);
-	bot_printf("PRIVMSG %s :!add - Add up to a pickup game\r\n", to);
-	bot_printf("PRIVMSG %s :!remove - Remove yourself from all pickups\r\n", to);
-	bot_printf("PRIVMSG %s :!who - List players added to pickups\r\n", to);
-	bot_printf("PRIVMSG %s :!promote - Promote a pickup game\r\n", to);
-	bot_printf("PRIVMSG %s :!servers - List recommended servers\r\n", to);
+	receiveQ3Info();
+	processAnnouncements();
+}
 
-	if (!irc_validateNick(to))
-		return;
+void queryTimerCallback(evtimer_t *timer)
+{
+	processAnnouncements();
+}
 
-	player_t *player = findNick(to);
+void initQueries(void)
+{
+	long long now = com_milliseconds();
+	int	i;
+
+	ev_timerInit(&bot.queryTimer, queryTimerCallback);
 
-	if (!player || !player->op)
+	bot.q3sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (bot.q3sock == -1) {
+		com_pwarning("initQueries: socket");
 		return;
+	}
+	bot.q3Ev.fd = bot.q3sock;
+	bot.q3Ev.callback = q3Callback;
+	ev_add(&bot.q3Ev, EPOLLIN);
 
-	bot_printf("PRIVMSG %s :!topic - Set channel topic\r\n");
+	// Warm up the cache
+	for (i = 0; i < sizeof(channelsArray) / sizeof(*channelsArray); i++)
+		refreshServers(channelsArray[i].pickupList, now);
 }
 
-void printVersion(const char *to)
+
+/* List manipulation
+ * functions
+ */
+
+pickupNode_t *pushPickup(pickupNode_t *node, pickup_t *pickup)
 {
-	bot_printf("PRIVMSG %s :jk2pugbot %s by fau <faltec@gmail.com>\r\n", to, botVersion);
-	bot_printf("PRIVMSG %s :Visit https://github.com/aufau/jk2pugbot for more\r\n", to);
+	pickupNode_t *pickupNode = com_malloc(sizeof(pickupNode_t));
+	pickupNode->pickup = pickup;
+	pickupNode->next = node;
+	return pickupNode;
 }
 
-void printGamesH(const pickupNode_t *node)
+pickupNode_t *popPickup(pickupNode_t *node)
 {
 	if (node) {
-		bot_printf(" %s", node->pickup->name);
-		printGamesH(node->next);
+		pickupNode_t *retval = node->next;
+		free(node);
+		return retval;
 	}
+	return NULL;
 }
 
-void printGames(const char *msg)
-{
-	bot_printf("PRIVMSG %s :Avaible pickup games are:", botChannel);
-	printGamesH(bot.pickupList);
-	bot_printf(". %s\r\n", msg);
-}
-
-/* Message Parsing
- * functions
- */
-
-pickup_t *findPickup(const pickupNode_t *node, const char *list)
+pickupNode_t *freePickupList(pickupNode_t *node)
 {
 	if (!node)
 		return NULL;
-	if (!strcasecmp(list, node->pickup->name))
-		return node->pickup;
 	else
-		return findPickup(node->next, list);
+		return freePickupList(popPickup(node));
 }
 
-pickupNode_t *parsePickupList(char *list)
+pickupNode_t *copyPickupList(const pickupNode_t *node)
 {
-	char *item;
-	pickup_t *pickup;
-
-	item = strtok(list, " ");
-	if (!item)
+	if (!node)
 		return NULL;
-	pickup = findPickup(bot.pickupList, item);
-
-	if (pickup)
-		return pushPickup(parsePickupList(NULL), pickup);
 	else
-		return parsePickupList(NULL);
+		return pushPickup(copyPickupList(node->next), node->pickup);
 }
 
-// Parses IRC message string with \r\n removed. Returns true on sucess
-// and false for malformed input.
-bool parseMessage(char *ptr, char *msgEnd, message_t *message)
-{
-	time_t epochTime;
-	struct tm *locTime;
-	char *trailingptr;
+/* Nick table
+ * functions
+ */
 
-	if (msgEnd - ptr > MAX_MSG_LEN - 2)
-		return false;
+// Returns slot holding nick or an empty slot where it belongs
+player_t **nickSlot(const nickTable_t *table, const char *nick, unsigned hash)
+{
+	unsigned mask = table->size - 1;
+	unsigned i = hash & mask;
 
-	*msgEnd = '\0';
+	while (table->slots[i]) {
+		player_t *player = table->slots[i];
 
-	time(&epochTime);
-	locTime = localtime(&epochTime);
-	printf("%02d:%02d >> %s\n", locTime->tm_hour, locTime->tm_min, ptr);
+		if (player->hash == hash && !irc_strcasecmp(player->nick, nick))
+			break;
+		i = (i + 1) & mask;
+	}
+	return &table->slots[i];
+}
 
-	memset(message, 0, sizeof(*message));
+void nickTableResize(nickTable_t *table, unsigned size)
+{
+	player_t **oldSlots = table->slots;
+	unsigned oldSize = table->size;
+	unsigned i;
 
-	// Find <trailing> sequence
-	trailingptr = strstr(ptr, " :");
-	if (trailingptr) {
-		trailingptr[0] = '\0';
-		trailingptr += 2;
-	}
-	message->trailing = trailingptr;
+	table->slots = com_malloc(size * sizeof(player_t *));
+	memset(table->slots, 0, size * sizeof(player_t *));
+	table->size = size;
 
-	// Parse prefix and command
-	strtok(ptr, " ");
-	if (ptr[0] == ':') {
-		char *prefixptr;
-		ptr++;
-		message->prefix.nick = strtok_r(ptr, "!", &prefixptr);
-		message->prefix.user = strtok_r(NULL, "@", &prefixptr);
-		message->prefix.host = strtok_r(NULL, "", &prefixptr);
+	for (i = 0; i < oldSize; i++) {
+		player_t *player = oldSlots[i];
 
-		ptr = strtok(NULL, " ");
-		if (!ptr)
-			return false;
-	} else {
-		memset(&message->prefix, 0, sizeof(message->prefix));
+		if (player)
+			*nickSlot(table, player->nick, player->hash) = player;
 	}
-	message->command = ptr;
+	free(oldSlots);
+}
 
-	// Parse <middle> parameters
-	int i = -1;
-	do {
-		i++;
-		message->parameter[i] = strtok(NULL, " ");
-	} while (i < 14 && message->parameter[i] != NULL);
+// Make room for one more player, keeping load factor under 3/4
+void nickReserve(nickTable_t *table)
+{
+	if (!table->size)
+		nickTableResize(table, NICK_TABLE_MIN_SIZE);
+	else if ((table->count + 1) * 4 > table->size * 3)
+		nickTableResize(table, table->size * 2);
+}
 
-	return true;
+void nickInsert(nickTable_t *table, player_t *player)
+{
+	player_t **slot;
+
+	nickReserve(table);
+	player->hash = irc_hashNick(player->nick);
+	slot = nickSlot(table, player->nick, player->hash);
+	assert(!*slot);
+	*slot = player;
+	table->count++;
 }
 
-void privmsgReply(char *cmd, const char *replyTo, const char *from)
+// Backward shift deletion, so there are no tombstones
+void nickRemove(nickTable_t *table, player_t *player)
 {
-	pickupNode_t *pickupList = NULL;
-	char *args;
+	unsigned mask = table->size - 1;
+	unsigned i = nickSlot(table, player->nick, player->hash) - table->slots;
+	unsigned j = i;
 
-	args = strchr(cmd, ' ');
-	if (args)
+	assert(table->slots[i] == player);
+
+	while (true) {
+		unsigned home;
+
+		table->slots[i] = NULL;
+		do {
+			j = (j + 1) & mask;
+			if (!table->slots[j]) {
+				table->count--;
+				return;
+			}
+			home = table->slots[j]->hash & mask;
+			// Move entry at j only if its home isn't cyclically in (i, j]
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+		table->slots[i] = table->slots[j];
+		i = j;
+	}
+}
+
+player_t *nickLookup(const nickTable_t *table, const char *nick)
+{
+	if (!table->count)
+		return NULL;
+	return *nickSlot(table, nick, irc_hashNick(nick));
+}
+
+// Nicks are stored inline, so player objects have to be resized
+// when server allows longer nicks. It's only possible when no player
+// is registered.
+void setNickLen(int nickLen)
+{
+	if (nickLen == bot.net->nickLen)
+		return;
+	if (bot.net->playerPool.used) {
+		if (nickLen > bot.net->nickLen)
+			com_warning("setNickLen: Nicks longer than %d characters won't be tracked",
+				    bot.net->nickLen);
+		return;
+	}
+
+	pool_destroy(&bot.net->playerPool);
+	pool_init(&bot.net->playerPool, sizeof(player_t) + nickLen + 1,
+		  SLAB_OBJS, botMaxPlayers);
+	bot.net->nickLen = nickLen;
+}
+
+// New player who isn't in the nick table yet or NULL if they can't
+// be tracked
+player_t *allocPlayer(const char *nick)
+{
+	player_t *player;
+
+	assert(irc_validateNick(nick));
+
+	if (strlen(nick) > bot.net->nickLen) {
+		com_warning("registerPlayer: Nick %s is too long", nick);
+		return NULL;
+	}
+	player = pool_alloc(&bot.net->playerPool);
+	if (!player) {
+		com_warning("registerPlayer: Too many players, not tracking %s", nick);
+		return NULL;
+	}
+	strcpy(player->nick, nick);
+	player->channels = 0;
+	player->ops = 0;
+	player->named = 0;
+	player->pickups = 0;
+	player->memberships = NULL;
+
+	if (!bot.net->self && !irc_strcasecmp(nick, bot.net->nick))
+		bot.net->self = player;
+
+	return player;
+}
+
+// Returns NULL if player can't be tracked
+player_t *registerPlayer(const char *nick)
+{
+	player_t *player = allocPlayer(nick);
+
+	if (player)
+		nickInsert(&bot.net->players, player);
+	return player;
+}
+
+// Find the player or register them with one probe of the nick table.
+// NAMES replies list mostly players we already know.
+player_t *namePlayer(const char *nick)
+{
+	nickTable_t *table = &bot.net->players;
+	unsigned hash = irc_hashNick(nick);
+	player_t **slot;
+
+	nickReserve(table);
+	slot = nickSlot(table, nick, hash);
+	if (!*slot && (*slot = allocPlayer(nick))) {
+		(*slot)->hash = hash;
+		table->count++;
+	}
+	return *slot;
+}
+
+serverNode_t *pushServer(serverNode_t *node, server_t *server)
+{
+	serverNode_t *serverNode = com_malloc(sizeof(serverNode_t));
+	serverNode->server = server;
+	serverNode->next = node;
+	return serverNode;
+}
+
+void addServer(pickupNode_t *node, server_t *server)
+{
+	if (node) {
+		node->pickup->serverList = pushServer(node->pickup->serverList, server);
+		addServer(node->next, server);
+	}
+}
+
+/* Pickup rosters
+ * functions
+ */
+
+member_t *findMember(const player_t *player, const pickup_t *pickup)
+{
+	member_t *member;
+
+	// Pickups of different channels share bits
+	if (!(player->pickups & (1u << pickup->id)))
+		return NULL;
+
+	for (member = player->memberships; member; member = member->nextMembership) {
+		if (member->pickup == pickup)
+			return member;
+	}
+	return NULL;
+}
+
+void linkMember(member_t *member)
+{
+	pickup_t *pickup = member->pickup;
+
+	member->prev = NULL;
+	member->next = pickup->playerList;
+	if (pickup->playerList)
+		pickup->playerList->prev = member;
+	pickup->playerList = member;
+}
+
+void unlinkMember(member_t *member)
+{
+	if (member->prev)
+		member->prev->next = member->next;
+	else
+		member->pickup->playerList = member->next;
+	if (member->next)
+		member->next->prev = member->prev;
+}
+
+void joinPickup(pickup_t *pickup, player_t *player)
+{
+	member_t *member = pool_alloc(&bot.memberPool);
+
+	member->player = player;
+	member->pickup = pickup;
+	linkMember(member);
+	member->nextMembership = player->memberships;
+	player->memberships = member;
+	player->pickups |= 1u << pickup->id;
+	pickup->count++;
+	updatePickupStatus(pickup);
+	snap_touchRoster(pickup);
+}
+
+void leavePickup(member_t *member)
+{
+	player_t *player = member->player;
+	member_t **node;
+
+	unlinkMember(member);
+	for (node = &player->memberships; *node != member;
+	     node = &(*node)->nextMembership)
+		;
+	*node = member->nextMembership;
+	player->pickups = 0;
+	for (node = &player->memberships; *node; node = &(*node)->nextMembership)
+		player->pickups |= 1u << (*node)->pickup->id;
+	member->pickup->count--;
+	updatePickupStatus(member->pickup);
+	snap_touchRoster(member->pickup);
+	pool_free(&bot.memberPool, member);
+}
+
+// Remove player from every pickup they joined
+void leavePickups(player_t *player)
+{
+	while (player->memberships)
+		leavePickup(player->memberships);
+}
+
+player_t *findNick(const char *nick)
+{
+	assert(irc_validateNick(nick));
+
+	return nickLookup(&bot.net->players, nick);
+}
+
+void removePlayer(pickupNode_t *node, player_t *player)
+{
+	if (node && player->pickups) {
+		member_t *member = findMember(player, node->pickup);
+		if (member)
+			leavePickup(member);
+		removePlayer(node->next, player);
+	}
+}
+
+void removePickupPlayers(pickup_t *pickup)
+{
+	while (pickup->playerList)
+		leavePickups(pickup->playerList->player);
+}
+
+// Start a game with the max players who have waited longest. The
+// rest stay queued.
+void startOldestPlayers(pickup_t *pickup)
+{
+	member_t *waiting = pickup->playerList;
+	member_t *member = waiting;
+	int	queued = pickup->count - pickup->max;
+	int	i;
+
+	assert(queued >= 0);
+
+	// playerList is newest first, so the starters are its tail
+	for (i = 0; i < queued; i++)
+		member = member->next;
+	if (queued) {
+		member->prev->next = NULL;
+		member->prev = NULL;
+	} else {
+		waiting = NULL;
+	}
+
+	pickup->playerList = member;
+	pickup->count = pickup->max;
+	announcePickup(pickup);
+	removePickupPlayers(pickup);
+
+	pickup->playerList = waiting;
+	pickup->count = queued;
+	updatePickupStatus(pickup);
+	snap_touchRoster(pickup);
+}
+
+void removeNick(pickupNode_t *node, const char *nick)
+{
+	player_t *player = findNick(nick);
+	if (player) {
+		removePlayer(node, player);
+	}
+}
+
+void forgetPlayer(player_t *player)
+{
+	leavePickups(player);
+	nickRemove(&bot.net->players, player);
+	if (player == bot.net->self)
+		bot.net->self = NULL;
+	pool_free(&bot.net->playerPool, player);
+}
+
+void forgetNick(const char *nick)
+{
+	player_t *player = findNick(nick);
+	if (player)
+		forgetPlayer(player);
+}
+
+void addPlayer(pickupNode_t *node, player_t *player)
+{
+	if (node) {
+		member_t *member = findMember(player, node->pickup);
+		if (member) {
+			// Move to the top
+			unlinkMember(member);
+			linkMember(member);
+			snap_touchRoster(node->pickup);
+		} else {
+			joinPickup(node->pickup, player);
+			if (node->pickup->max && node->pickup->count == node->pickup->max) {
+				announcePickup(node->pickup);
+				removePickupPlayers(node->pickup);
+				return;
+			}
+		}
+		addPlayer(node->next, player);
+	}
+}
+
+void addNick(channel_t *channel, pickupNode_t *node, const char *nick)
+{
+	player_t *player = findNick(nick);
+	if (!player && node) {
+		player = registerPlayer(nick);
+		com_warning("addNick: Player %s was not registered", nick);
+	}
+
+	if (player) {
+		player->channels |= channelBit(channel);
+		addPlayer(node, player);
+	}
+}
+
+void changeNick(const char *nick, const char *newnick)
+{
+	player_t *player = findNick(nick);
+	player_t *stale;
+	member_t *member;
+
+	if (!player)
+		return;
+
+	if (strlen(newnick) > bot.net->nickLen) {
+		com_warning("changeNick: Nick %s is too long", newnick);
+		forgetPlayer(player);
+		return;
+	}
+	// Whoever we think has newnick must have left unseen
+	stale = findNick(newnick);
+	if (stale && stale != player) {
+		com_warning("changeNick: Player %s was already known", newnick);
+		forgetPlayer(stale);
+	}
+	nickRemove(&bot.net->players, player);
+	strcpy(player->nick, newnick);
+	nickInsert(&bot.net->players, player);
+	for (member = player->memberships; member; member = member->nextMembership)
+		snap_touchRoster(member->pickup);
+}
+
+/* Channels
+ * functions
+ */
+
+channelMask_t channelBit(const channel_t *channel)
+{
+	return (channelMask_t)1 << channel->id;
+}
+
+network_t *findNetwork(const char *name)
+{
+	int i;
+
+	for (i = 0; i < bot.networkCount; i++) {
+		if (!strcmp(bot.networks[i].name, name))
+			return &bot.networks[i];
+	}
+	return NULL;
+}
+
+channel_t *findChannel(const char *name)
+{
+	int i;
+
+	for (i = 0; i < bot.net->channelCount; i++) {
+		if (!irc_strcasecmp(bot.net->channels[i]->name, name))
+			return bot.net->channels[i];
+	}
+	return NULL;
+}
+
+// Commands sent in a query are for the first channel we share with
+// the player
+channel_t *queryChannel(const player_t *player)
+{
+	if (player && player->channels)
+		return bot.net->channels[__builtin_ctzll(player->channels)];
+	return bot.net->channels[0];
+}
+
+void setOp(player_t *player, channel_t *channel, bool op)
+{
+	if (op)
+		player->ops |= channelBit(channel);
+	else
+		player->ops &= ~channelBit(channel);
+}
+
+bool isOp(const player_t *player, const channel_t *channel)
+{
+	return player && (player->ops & channelBit(channel));
+}
+
+// Remove player from pickups of the channel. Players who aren't in
+// any of our channels are forgotten.
+void leaveChannel(player_t *player, channel_t *channel)
+{
+	member_t *member;
+	member_t *next;
+
+	for (member = player->memberships; member; member = next) {
+		next = member->nextMembership;
+		if (member->pickup->channel == channel)
+			leavePickup(member);
+	}
+	player->channels &= ~channelBit(channel);
+	player->ops &= ~channelBit(channel);
+	player->named &= ~channelBit(channel);
+
+	if (!player->channels && player != bot.net->self)
+		forgetPlayer(player);
+}
+
+// We left the channel, so nobody can be seen in it
+void clearChannel(channel_t *channel)
+{
+	unsigned i = 0;
+
+	while (i < bot.net->players.size) {
+		player_t *player = bot.net->players.slots[i];
+
+		// Forgetting a player may shift another one into this slot
+		if (player && player != bot.net->self &&
+		    (player->channels & channelBit(channel))) {
+			leaveChannel(player, channel);
+			continue;
+		}
+		i++;
+	}
+	if (bot.net->self)
+		leaveChannel(bot.net->self, channel);
+	channel->sentTopic[0] = '\0';
+	// Keep saved rosters until we are back
+	channel->snapSynced = false;
+}
+
+// NAMES list of the channel ended. Players who weren't on it left
+// while we couldn't see them, the rest are marked unlisted again.
+void sweepChannel(channel_t *channel)
+{
+	channelMask_t bit = channelBit(channel);
+	unsigned i = 0;
+
+	while (i < bot.net->players.size) {
+		player_t *player = bot.net->players.slots[i];
+
+		// Forgetting a player may shift another one into this slot
+		if (player && (player->channels & bit) && !(player->named & bit)) {
+			leaveChannel(player, channel);
+			continue;
+		}
+		i++;
+	}
+	// Entries could wrap around while shifting, so unmark afterwards
+	for (i = 0; i < bot.net->players.size; i++) {
+		if (bot.net->players.slots[i])
+			bot.net->players.slots[i]->named &= ~bit;
+	}
+}
+
+/* Line packing
+ * functions
+ */
+
+void lp_begin(linePacker_t *lp, const char *to, const char *sep)
+{
+	lp->maxLen = MAX_MSG_LEN - 2 - bot.net->relayPrefixLen;
+	lp->headLen = snprintf(lp->line, sizeof(lp->line), "PRIVMSG %s :", to);
+	if (lp->headLen >= lp->maxLen)
+		lp->headLen = lp->maxLen - 1;
+	lp->len = lp->headLen;
+	lp->sep = sep;
+	lp->needSep = false;
+}
+
+void lp_flush(linePacker_t *lp)
+{
+	if (lp->len > lp->headLen)
+		bot_printf("%.*s\r\n", lp->len, lp->line);
+	lp->len = lp->headLen;
+	lp->needSep = false;
+}
+
+void lp_vappend(linePacker_t *lp, bool item, const char *format, va_list ap)
+{
+	char	buf[MAX_MSG_LEN];
+	int	sepLen = 0;
+	int	len;
+
+	len = vsnprintf(buf, sizeof(buf), format, ap);
+	if (len < 0)
+		return;
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+
+	if (item && lp->needSep)
+		sepLen = strlen(lp->sep);
+	if (lp->len + sepLen + len > lp->maxLen && lp->len > lp->headLen) {
+		lp_flush(lp);
+		sepLen = 0;
+	}
+	// Cut what doesn't fit even on its own line
+	if (lp->len + sepLen + len > lp->maxLen)
+		len = lp->maxLen - lp->len - sepLen;
+
+	memcpy(lp->line + lp->len, lp->sep, sepLen);
+	memcpy(lp->line + lp->len + sepLen, buf, len);
+	lp->len += sepLen + len;
+	lp->needSep = item;
+}
+
+// Text that belongs to the next item, like a list header
+void lp_text(linePacker_t *lp, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	lp_vappend(lp, false, format, ap);
+	va_end(ap);
+}
+
+void lp_item(linePacker_t *lp, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	lp_vappend(lp, true, format, ap);
+	va_end(ap);
+}
+
+void packPlayers(linePacker_t *lp, const member_t *node)
+{
+	for (; node; node = node->next)
+		lp_item(lp, "%s", node->player->nick);
+}
+
+// Render the part of the channel topic that shows pickup count
+void updatePickupStatus(pickup_t *pickup)
+{
+	char	status[MAX_STATUS_LEN];
+	const char *formatString;
+	int	len = 0;
+
+	if (botPrintEmpty || pickup->count) {
+		if (pickup->max) {
+			formatString = pickup->count ?
+				"\x02(\x02 %s %d/%d \x02)\x02" :
+				"( %s %d/%d )";
+			len = snprintf(status, sizeof(status), formatString,
+				       pickup->name, pickup->count, pickup->max);
+		} else {
+			formatString = pickup->count ?
+				"\x02(\x02 %s %d \x02)\x02" :
+				"( %s %d )";
+			len = snprintf(status, sizeof(status), formatString,
+				       pickup->name, pickup->count);
+		}
+		if (len >= sizeof(status))
+			len = sizeof(status) - 1;
+	}
+
+	if (len == pickup->statusLen && !memcmp(status, pickup->status, len))
+		return;
+
+	memcpy(pickup->status, status, len);
+	pickup->statusLen = len;
+	pickup->channel->statusChanged = true;
+	pickup->channel->net->statusChanged = true;
+}
+
+void packServers(linePacker_t *lp, const serverNode_t *node)
+{
+	if (node) {
+		const server_t *server = node->server;
+
+		if (server->status == SV_UP) {
+			lp_item(lp, "\x02(\x02 %s %d/%d %s:%s \x02)\x02",
+				server->name, server->info.clients,
+				server->info.maxclients, server->address,
+				server->port);
+		} else if (server->status == SV_ERROR) {
+			lp_item(lp, "\x02(\x02 %s %s:%s \x02)\x02",
+				server->name, server->address, server->port);
+		}
+		packServers(lp, node->next);
+	}
+}
+
+void setTopic(channel_t *channel, const char *newTopic)
+{
+	if (!newTopic)
+		return;
+
+	if (channel->topic)
+		free(channel->topic);
+
+	channel->topic = com_strdup(newTopic);
+	snap_saveTopic(channel);
+}
+
+// Set the channel topic unless it's the same as last time
+void updateStatus(channel_t *channel)
+{
+	char	topic[MAX_MSG_LEN];
+	const pickupNode_t *node;
+	int	len = 0;
+
+	// Not in the channel
+	if (!bot.net->self || !(bot.net->self->channels & channelBit(channel)))
+		return;
+
+	for (node = channel->pickupList; node; node = node->next) {
+		if (len + node->pickup->statusLen >= sizeof(topic))
+			break;
+		memcpy(topic + len, node->pickup->status, node->pickup->statusLen);
+		len += node->pickup->statusLen;
+	}
+	snprintf(topic + len, sizeof(topic) - len,
+		 "\x02(\x02 %s \x02)(\x02 Type !help \x02)\x02", channel->topic);
+
+	if (!strcmp(topic, channel->sentTopic))
+		return;
+
+	bot_printf("TOPIC %s :%s\r\n", channel->name, topic);
+	strcpy(channel->sentTopic, topic);
+}
+
+// Update topics botTopicDelay milliseconds after the last change but
+// no later than botTopicMaxDelay after the first one. One timer serves
+// all channels, it's set for the earliest update.
+void scheduleStatus(void)
+{
+	long long now = com_milliseconds();
+	long long next = 0;
+	int	i;
+
+	for (i = 0; i < bot.net->channelCount; i++) {
+		channel_t *channel = bot.net->channels[i];
+
+		if (channel->statusChanged) {
+			if (!channel->statusDeadline)
+				channel->statusDeadline = now + botTopicMaxDelay;
+			channel->statusDue = now + botTopicDelay;
+			if (channel->statusDue > channel->statusDeadline)
+				channel->statusDue = channel->statusDeadline;
+			channel->statusChanged = false;
+		}
+		if (channel->statusDue && (!next || channel->statusDue < next))
+			next = channel->statusDue;
+	}
+
+	bot.net->statusChanged = false;
+	if (next)
+		ev_timerSet(&bot.net->statusTimer, next > now ? next - now : 1, 0);
+}
+
+void statusTimeout(evtimer_t *timer)
+{
+	long long now = com_milliseconds();
+	int	i;
+
+	bot.net = timer->ctx;
+	for (i = 0; i < bot.net->channelCount; i++) {
+		channel_t *channel = bot.net->channels[i];
+
+		if (channel->statusDue && channel->statusDue <= now) {
+			channel->statusDue = 0;
+			channel->statusDeadline = 0;
+			updateStatus(channel);
+		}
+	}
+	scheduleStatus();
+}
+
+void announceServersH(const pickupNode_t *node, const char *to)
+{
+	if (node) {
+		if (node->pickup->serverList) {
+			linePacker_t lp;
+
+			lp_begin(&lp, to, "");
+			lp_text(&lp, "Recommended %s servers: ", node->pickup->name);
+			packServers(&lp, node->pickup->serverList);
+			lp_flush(&lp);
+		}
+
+		announceServersH(node->next, to);
+	}
+}
+
+// Print announcements whose game servers replied or timed out
+void printAnnouncement(const announcement_t *announcement)
+{
+	bot.net = announcement->net;
+	bot_setOutClass(announcement->outClass);
+	announceServersH(announcement->pickupList, announcement->to);
+	bot_setOutClass(OUT_AUTO);
+}
+
+// Unlink the announcement node points to and free it
+void popAnnouncement(announcement_t **node)
+{
+	announcement_t *announcement = *node;
+
+	*node = announcement->next;
+	freePickupList(announcement->pickupList);
+	free(announcement->to);
+	free(announcement);
+}
+
+void processAnnouncements(void)
+{
+	announcement_t **node = &bot.announcements;
+	long long now = com_milliseconds();
+
+	while (*node) {
+		announcement_t *announcement = *node;
+
+		// Lookups aren't bounded by botQueryTimeout like queries are
+		if (refreshServers(announcement->pickupList, now) &&
+		    now < announcement->deadline) {
+			node = &announcement->next;
+			continue;
+		}
+
+		printAnnouncement(announcement);
+		popAnnouncement(node);
+	}
+
+	if (bot.announcements) {
+		long long delay = bot.announcements->deadline - now + 1;
+
+		ev_timerSet(&bot.queryTimer, delay > 0 ? delay : 1, 0);
+	} else
+		ev_timerSet(&bot.queryTimer, 0, 0);
+}
+
+// Drop announcements for the network
+void freeAnnouncements(const network_t *net)
+{
+	announcement_t **node = &bot.announcements;
+
+	while (*node) {
+		announcement_t *announcement = *node;
+
+		if (announcement->net != net) {
+			node = &announcement->next;
+			continue;
+		}
+		popAnnouncement(node);
+	}
+	if (!bot.announcements)
+		ev_timerSet(&bot.queryTimer, 0, 0);
+}
+
+// Print announcements right away with whatever servers replied so far
+void finishAnnouncements(void)
+{
+	if (!bot.announcements)
+		return;
+
+	while (bot.announcements) {
+		printAnnouncement(bot.announcements);
+		popAnnouncement(&bot.announcements);
+	}
+	ev_timerSet(&bot.queryTimer, 0, 0);
+}
+
+// Fresh and slightly stale game server status is printed right
+// away. Otherwise the announcement waits until servers reply, at most
+// botQueryTimeout milliseconds.
+void announceServers(const pickupNode_t *node, const char *to)
+{
+	announcement_t **tail;
+	announcement_t *announcement;
+	long long now = com_milliseconds();
+
+	if (!refreshServers(node, now)) {
+		announceServersH(node, to);
+		return;
+	}
+
+	announcement = com_malloc(sizeof(announcement_t));
+	announcement->net = bot.net;
+	announcement->pickupList = copyPickupList(node);
+	announcement->to = com_strdup(to);
+	announcement->deadline = now + botQueryTimeout;
+	announcement->outClass = bot.net->outClass;
+	announcement->next = NULL;
+
+	for (tail = &bot.announcements; *tail; tail = &(*tail)->next)
+		;
+	*tail = announcement;
+
+	if (announcement == bot.announcements)
+		ev_timerSet(&bot.queryTimer, botQueryTimeout + 1, 0);
+}
+
+void announcePickup(pickup_t *pickup)
+{
+	linePacker_t lp;
+	pickupNode_t *node;
+	const member_t *member = pickup->playerList;
+	const char *target;
+	char	targets[MAX_MSG_LEN / 2];
+	bool	channelDone = false;
+	int	len;
+	int	n;
+
+	// Highlight players privately and in the channel, at most
+	// maxTargets at once. Target lists eat into the line length so
+	// they are kept to half of it.
+	bot_setOutClass(OUT_HIGHLIGHT);
+	while (!channelDone) {
+		len = 0;
+		for (n = 0; !bot.net->maxTargets || n < bot.net->maxTargets; n++) {
+			target = member ? member->player->nick : pickup->channel->name;
+			if (len + strlen(target) + 1 >= sizeof(targets) && n)
+				break;
+
+			len += snprintf(targets + len, sizeof(targets) - len, "%s%s",
+					n ? "," : "", target);
+			if (!member) {
+				channelDone = true;
+				break;
+			}
+			member = member->next;
+		}
+
+		lp_begin(&lp, targets, ", ");
+		lp_text(&lp, "\x02%s pickup is ready to start!\x02 Players are: ",
+			pickup->name);
+		packPlayers(&lp, pickup->playerList);
+		lp_flush(&lp);
+	}
+
+	node = pushPickup(NULL, pickup);
+	announceServers(node, pickup->channel->name);
+	popPickup(node);
+	bot_setOutClass(OUT_AUTO);
+}
+
+void announcePlayers(const pickupNode_t *node, const char *to)
+{
+	if (node) {
+		if (node->pickup->count) {
+			linePacker_t lp;
+
+			lp_begin(&lp, to, ", ");
+			if (node->pickup->max) {
+				lp_text(&lp, "\x02(\x02 %s %d/%d \x02)\x02 Players are: ",
+					node->pickup->name, node->pickup->count,
+					node->pickup->max);
+			} else {
+				lp_text(&lp, "\x02(\x02 %s %d \x02)\x02 Players are: ",
+					node->pickup->name, node->pickup->count);
+			}
+
+			packPlayers(&lp, node->pickup->playerList);
+			lp_flush(&lp);
+		}
+		announcePlayers(node->next, to);
+	}
+}
+
+void promotePickup(const pickupNode_t *node)
+{
+	const char *pluralSuffix;
+	const char *pluralSuffixLeft;
+	const char *beForm;
+	const char *channel;
+	pickupNode_t *pickupNode;
+
+	if (node) {
+		channel = node->pickup->channel->name;
+		if (node->pickup->count == 1) {
+			pluralSuffix = "";
+			beForm = "is";
+		} else {
+			pluralSuffix = "s";
+			beForm = "are";
+		}
+		if (node->pickup->max - node->pickup->count == 1)
+			pluralSuffixLeft = "";
+		else
+			pluralSuffixLeft = "s";
+
+		if (node->pickup->max && node->pickup->count) {
+			bot_printf("PRIVMSG %s :\x02Only %d player%s needed for %s game!\x02 Type !add %s to sign up.\r\n",
+			    channel, node->pickup->max - node->pickup->count,
+			    pluralSuffixLeft, node->pickup->name, node->pickup->name);
+		} else if (node->pickup->count == 1 && !botSilentWho) {
+			bot_printf("PRIVMSG %s :\x02Wanna play %s? %s is waiting!\x02 Type !add %s\r\n",
+			    channel, node->pickup->name,
+			    node->pickup->playerList->player->nick, node->pickup->name);
+		} else if (node->pickup->count) {
+			bot_printf("PRIVMSG %s :\x02Wanna play %s? There %s %d player%s waiting!\x02 Type !add %s\r\n",
+			    channel, node->pickup->name, beForm, node->pickup->count,
+			    pluralSuffix, node->pickup->name);
+
+			if (!botSilentWho) {
+				pickupNode = pushPickup(NULL, node->pickup);
+				announcePlayers(pickupNode, channel);
+				popPickup(pickupNode);
+			}
+		}
+		promotePickup(node->next);
+	}
+}
+
+void printVersion(const char *to)
+{
+	bot_printf("PRIVMSG %s :jk2pugbot %s by fau <faltec@gmail.com>\r\n", to, botVersion);
+	bot_printf("PRIVMSG %s :Visit https://github.com/aufau/jk2pugbot for more\r\n", to);
+}
+
+void printGamesH(const pickupNode_t *node)
+{
+	if (node) {
+		bot_printf(" %s", node->pickup->name);
+		printGamesH(node->next);
+	}
+}
+
+void printGames(const channel_t *channel, const char *msg)
+{
+	bot_printf("PRIVMSG %s :Avaible pickup games are:", channel->name);
+	printGamesH(channel->pickupList);
+	bot_printf(". %s\r\n", msg);
+}
+
+/* State snapshot
+ * functions
+ */
+
+snapChannel_t *snap_channels(const snapHeader_t *snap)
+{
+	return (snapChannel_t *)(snap + 1);
+}
+
+snapServer_t *snap_servers(const snapHeader_t *snap)
+{
+	return (snapServer_t *)(snap_channels(snap) + snap->channels);
+}
+
+char *snap_rosters(const snapHeader_t *snap)
+{
+	return (char *)(snap_servers(snap) + snap->servers);
+}
+
+size_t snap_size(size_t channels, size_t servers, size_t rosterSpace)
+{
+	return sizeof(snapHeader_t) + channels * sizeof(snapChannel_t) +
+		servers * sizeof(snapServer_t) + rosterSpace;
+}
+
+// Fixed size fields are zero padded, so equal strings compare equal
+void snap_copy(char *field, const char *s, size_t size)
+{
+	size_t len = strlen(s);
+
+	if (len >= size)
+		len = size - 1;
+	memcpy(field, s, len);
+	memset(field + len, 0, size - len);
+}
+
+bool snap_equal(const char *field, const char *s, size_t size)
+{
+	return !strncmp(field, s, size - 1);
+}
+
+// String read from the file, or NULL if it isn't terminated
+const char *snap_string(const char *field, size_t size)
+{
+	return memchr(field, '\0', size) ? field : NULL;
+}
+
+// Roster at *offset in the roster area, which is moved past it. NULL
+// at the end of the area or where it doesn't hold together.
+const snapRoster_t *snap_roster(const snapHeader_t *snap, uint32_t *offset)
+{
+	const snapRoster_t *roster;
+	uint32_t left = snap->rosterBytes - *offset;
+
+	if (left < sizeof(snapRoster_t))
+		return NULL;
+	roster = (const snapRoster_t *)(snap_rosters(snap) + *offset);
+	if (roster->size % 8 || roster->size > left - sizeof(snapRoster_t))
+		return NULL;
+	*offset += sizeof(snapRoster_t) + roster->size;
+	return roster;
+}
+
+// Add a roster record of size bytes of nicks to bot.snapBuf
+snapRoster_t *snap_appendRoster(const char *pickup, uint32_t channel, uint32_t size)
+{
+	snapRoster_t *roster;
+	size_t	len = bot.snapBufLen + sizeof(snapRoster_t) + size;
+
+	if (len > bot.snapBufSize) {
+		size_t bufSize = bot.snapBufSize ? bot.snapBufSize : SNAPSHOT_SLACK;
+
+		while (bufSize < len)
+			bufSize *= 2;
+		bot.snapBuf = com_realloc(bot.snapBuf, bufSize);
+		bot.snapBufSize = bufSize;
+	}
+
+	roster = (snapRoster_t *)(bot.snapBuf + bot.snapBufLen);
+	memset(roster, 0, sizeof(snapRoster_t) + size);
+	snap_copy(roster->pickup, pickup, SNAPSHOT_NAME_LEN);
+	roster->channel = channel;
+	roster->size = size;
+	bot.snapBufLen = len;
+	return roster;
+}
+
+void snap_copyRoster(const snapRoster_t *old, uint32_t channel)
+{
+	snapRoster_t *roster = snap_appendRoster(old->pickup, channel, old->size);
+
+	roster->count = old->count;
+	memcpy(roster + 1, old + 1, old->size);
+}
+
+// Players of a pickup, most recent first. Empty rosters aren't saved.
+void snap_packRoster(const pickup_t *pickup)
+{
+	const member_t *member;
+	snapRoster_t *roster;
+	char	*nicks;
+	uint32_t size = 0;
+	uint32_t count = 0;
+
+	for (member = pickup->playerList; member && count < SNAPSHOT_ROSTER;
+	     member = member->next, count++)
+		size += strlen(member->player->nick) + 1;
+	if (!count)
+		return;
+
+	roster = snap_appendRoster(pickup->name, pickup->channel->snapId,
+				   (size + 7) & ~7u);
+	roster->count = count;
+	nicks = (char *)(roster + 1);
+	for (member = pickup->playerList; count--; member = member->next) {
+		strcpy(nicks, member->player->nick);
+		nicks += strlen(nicks) + 1;
+	}
+}
+
+// Make the roster area space bytes long. The snapshot is dropped if
+// the file can't be mapped again.
+bool snap_grow(uint32_t space)
+{
+	const char *path = botSnapshotFile;
+	size_t	size = snap_size(bot.snap->channels, bot.snap->servers, space);
+	int	fd;
+
+	if (!path)
+		return false;
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd == -1 || ftruncate(fd, size)) {
+		com_pwarning("snap_grow");
+		if (fd != -1)
+			close(fd);
+		return false;
+	}
+
+	munmap(bot.snap, bot.snapSize);
+	bot.snap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (bot.snap == MAP_FAILED) {
+		com_pwarning("snap_grow: mmap");
+		bot.snap = NULL;
+		return false;
+	}
+	bot.snapSize = size;
+	bot.snap->rosterSpace = space;
+	return true;
+}
+
+void snap_saveTopic(const channel_t *channel)
+{
+	if (bot.snap && channel->topic)
+		snap_copy(snap_channels(bot.snap)[channel->snapId].topic,
+			  channel->topic, MAX_MSG_LEN);
+}
+
+void snap_touchRoster(pickup_t *pickup)
+{
+	if (bot.snap)
+		bot.snapDirty = true;
+}
+
+// Write the roster area again from current rosters. Rosters of a
+// channel we haven't got back into yet are kept as they were.
+void snap_saveRosters(void)
+{
+	const snapRoster_t *roster;
+	pickupNode_t *node;
+	uint32_t offset;
+	int	i;
+
+	bot.snapBufLen = 0;
+	for (i = 0; i < sizeof(channelsArray) / sizeof(*channelsArray); i++) {
+		if (channelsArray[i].snapSynced) {
+			for (node = channelsArray[i].pickupList; node; node = node->next)
+				snap_packRoster(node->pickup);
+			continue;
+		}
+		for (offset = 0; (roster = snap_roster(bot.snap, &offset)); ) {
+			if (roster->channel == i)
+				snap_copyRoster(roster, i);
+		}
+	}
+
+	if (bot.snapBufLen > bot.snap->rosterSpace &&
+	    !snap_grow(bot.snapBufLen + SNAPSHOT_SLACK))
+		return;
+	if (bot.snapBufLen)
+		memcpy(snap_rosters(bot.snap), bot.snapBuf, bot.snapBufLen);
+	bot.snap->rosterBytes = bot.snapBufLen;
+}
+
+void snap_saveServer(const server_t *server)
+{
+	snapServer_t *record = &snap_servers(bot.snap)[server->snapId];
+
+	record->status = server->status;
+	record->clients = server->info.clients;
+	record->maxclients = server->info.maxclients;
+	record->updated = server->status == SV_UNKNOWN ? 0 :
+		server->updated + bot.snapClock;
+}
+
+// Save what changed during this event loop iteration
+void snap_flush(void)
+{
+	int	i;
+
+	if (bot.snapDirty && bot.snap) {
+		bot.snapDirty = false;
+		snap_saveRosters();
+	}
+	if (bot.snapServers && bot.snap) {
+		bot.snapServers = false;
+		for (i = 0; i < bot.serverCount; i++)
+			snap_saveServer(&bot.servers[i]);
+	}
+}
+
+// Put players who are still in the channel back into saved rosters.
+// Called when the channel's NAMES list ends.
+void snap_restoreRosters(channel_t *channel)
+{
+	const snapRoster_t *roster;
+	const char *nicks[SNAPSHOT_ROSTER];
+	pickupNode_t *node;
+	uint32_t offset;
+	int	count;
+
+	if (!bot.snap || channel->snapSynced)
+		return;
+
+	for (offset = 0; (roster = snap_roster(bot.snap, &offset)); ) {
+		const char *nick = (const char *)(roster + 1);
+		const char *end = nick + roster->size;
+		pickup_t *pickup = NULL;
+
+		if (roster->channel != channel->snapId)
+			continue;
+		for (node = channel->pickupList; node && !pickup; node = node->next) {
+			if (snap_equal(roster->pickup, node->pickup->name, SNAPSHOT_NAME_LEN))
+				pickup = node->pickup;
+		}
+		if (!pickup)
+			continue;
+
+		for (count = 0; count < roster->count && count < SNAPSHOT_ROSTER &&
+			     nick < end && memchr(nick, '\0', end - nick); count++) {
+			nicks[count] = nick;
+			nick += strlen(nick) + 1;
+		}
+
+		// Oldest first, so they end up in the same order
+		while (count--) {
+			player_t *player;
+
+			if (!irc_validateNick(nicks[count]))
+				continue;
+			player = findNick(nicks[count]);
+			if (player && (player->channels & channelBit(channel)) &&
+			    !findMember(player, pickup))
+				joinPickup(pickup, player);
+		}
+		// A full roster would never start, adds only check for max
+		while (pickup->max && pickup->count >= pickup->max)
+			startOldestPlayers(pickup);
+	}
+	// Drop whoever didn't come back
+	bot.snapDirty = true;
+	channel->snapSynced = true;
+}
+
+const snapChannel_t *snap_findChannel(const snapHeader_t *snap, const channel_t *channel)
+{
+	const snapChannel_t *record = snap_channels(snap);
+	int	i;
+
+	for (i = 0; i < snap->channels; i++, record++) {
+		if (snap_equal(record->name, channel->name, SNAPSHOT_NAME_LEN) &&
+		    snap_equal(record->network, channel->network, SNAPSHOT_NAME_LEN))
+			return record;
+	}
+	return NULL;
+}
+
+const snapServer_t *snap_findServer(const snapHeader_t *snap, const server_t *server)
+{
+	const snapServer_t *record = snap_servers(snap);
+	int	i;
+
+	for (i = 0; i < snap->servers; i++, record++) {
+		if (snap_equal(record->name, server->name, SNAPSHOT_NAME_LEN))
+			return record;
+	}
+	return NULL;
+}
+
+bool snap_valid(const snapHeader_t *snap, size_t size)
+{
+	return size >= sizeof(snapHeader_t) &&
+		!memcmp(snap->magic, SNAPSHOT_MAGIC, sizeof(snap->magic)) &&
+		snap->version == SNAPSHOT_VERSION &&
+		snap->channels <= size / sizeof(snapChannel_t) &&
+		snap->servers <= size / sizeof(snapServer_t) &&
+		snap->rosterBytes <= snap->rosterSpace &&
+		snap_size(snap->channels, snap->servers, snap->rosterSpace) <= size;
+}
+
+// Every record is where the configuration expects it. Rosters are
+// found by name when they are restored.
+bool snap_matches(const snapHeader_t *snap)
+{
+	int	channelCount = sizeof(channelsArray) / sizeof(*channelsArray);
+	int	i;
+
+	if (snap->channels != channelCount || snap->servers != bot.serverCount)
+		return false;
+
+	for (i = 0; i < channelCount; i++) {
+		if (snap_findChannel(snap, &channelsArray[i]) != &snap_channels(snap)[i])
+			return false;
+	}
+	for (i = 0; i < bot.serverCount; i++) {
+		if (snap_findServer(snap, &bot.servers[i]) != &snap_servers(snap)[i])
+			return false;
+	}
+	return true;
+}
+
+// Lay out records for the current configuration and carry over
+// whatever old snapshot has for the same channels, pickups and
+// servers. Roster area of snap must fit all of old's rosters.
+void snap_layout(snapHeader_t *snap, const snapHeader_t *old)
+{
+	int	channelCount = sizeof(channelsArray) / sizeof(*channelsArray);
+	int	i;
+
+	memcpy(snap->magic, SNAPSHOT_MAGIC, sizeof(snap->magic));
+	snap->version = SNAPSHOT_VERSION;
+	snap->channels = channelCount;
+	snap->servers = bot.serverCount;
+
+	bot.snapBufLen = 0;
+	for (i = 0; i < channelCount; i++) {
+		const channel_t *channel = &channelsArray[i];
+		const snapChannel_t *oldRecord = old ? snap_findChannel(old, channel) : NULL;
+		snapChannel_t *record = &snap_channels(snap)[i];
+		const snapRoster_t *roster;
+		const pickupNode_t *node;
+		uint32_t offset;
+
+		if (oldRecord)
+			memcpy(record->topic, oldRecord->topic, MAX_MSG_LEN);
+		else if (channel->topic)
+			snap_copy(record->topic, channel->topic, MAX_MSG_LEN);
+		snap_copy(record->network, channel->network, SNAPSHOT_NAME_LEN);
+		snap_copy(record->name, channel->name, SNAPSHOT_NAME_LEN);
+
+		if (!oldRecord)
+			continue;
+		for (offset = 0; (roster = snap_roster(old, &offset)); ) {
+			if (roster->channel != oldRecord - snap_channels(old))
+				continue;
+			for (node = channel->pickupList; node; node = node->next) {
+				if (snap_equal(roster->pickup, node->pickup->name,
+					       SNAPSHOT_NAME_LEN)) {
+					snap_copyRoster(roster, i);
+					break;
+				}
+			}
+		}
+	}
+	assert(bot.snapBufLen <= snap->rosterSpace);
+	if (bot.snapBufLen)
+		memcpy(snap_rosters(snap), bot.snapBuf, bot.snapBufLen);
+	snap->rosterBytes = bot.snapBufLen;
+
+	for (i = 0; i < bot.serverCount; i++) {
+		const snapServer_t *oldRecord = old ? snap_findServer(old, &bot.servers[i]) : NULL;
+		snapServer_t *record = &snap_servers(snap)[i];
+
+		if (oldRecord)
+			*record = *oldRecord;
+		snap_copy(record->name, bot.servers[i].name, SNAPSHOT_NAME_LEN);
+	}
+}
+
+// Topics and server status recent enough to be served. Rosters wait
+// for the channels' NAMES lists.
+void snap_restore(void)
+{
+	long long now = com_milliseconds();
+	int	i;
+
+	for (i = 0; i < sizeof(channelsArray) / sizeof(*channelsArray); i++) {
+		const snapChannel_t *record = &snap_channels(bot.snap)[i];
+		const char *topic = snap_string(record->topic, MAX_MSG_LEN);
+
+		if (topic && topic[0])
+			setTopic(&channelsArray[i], topic);
+	}
+
+	for (i = 0; i < bot.serverCount; i++) {
+		const snapServer_t *record = &snap_servers(bot.snap)[i];
+		server_t *server = &bot.servers[i];
+		long long updated = record->updated - bot.snapClock;
+
+		if (!record->updated || updated > now ||
+		    now - updated >= botServerMaxAge * 1000LL)
+			continue;
+		if (record->status != SV_UP && record->status != SV_DOWN &&
+		    record->status != SV_ERROR)
+			continue;
+		server->status = record->status;
+		server->info.clients = record->clients;
+		server->info.maxclients = record->maxclients;
+		server->updated = updated;
+	}
+}
+
+// Lay out the file again for the current configuration and map it.
+// Records are carried over from the old mapping, which is unmapped.
+void snap_rewrite(int fd, snapHeader_t *old, size_t oldSize)
+{
+	uint32_t space = (old ? old->rosterBytes : 0) + SNAPSHOT_SLACK;
+	size_t	size = snap_size(sizeof(channelsArray) / sizeof(*channelsArray),
+				 bot.serverCount, space);
+	snapHeader_t *snap = calloc(1, size);
+
+	if (!snap)
+		com_perror("calloc");
+	snap->rosterSpace = space;
+	snap_layout(snap, old);
+	if (old)
+		munmap(old, oldSize);
+	bot.snap = NULL;
+
+	if (ftruncate(fd, size) || pwrite(fd, snap, size, 0) != size) {
+		com_pwarning("snap_rewrite: write");
+		free(snap);
+		return;
+	}
+	free(snap);
+
+	bot.snap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (bot.snap == MAP_FAILED) {
+		com_pwarning("snap_rewrite: mmap");
+		bot.snap = NULL;
+		return;
+	}
+	bot.snapSize = size;
+}
+
+void initSnapshot(void)
+{
+	const char *path = botSnapshotFile;
+	snapHeader_t *old = NULL;
+	struct stat st;
+	int	fd;
+
+	if (!path)
+		return;
+
+	bot.snapClock = time(NULL) * 1000LL - com_milliseconds();
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1 || fstat(fd, &st)) {
+		com_pwarning(path);
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+
+	if (st.st_size >= sizeof(snapHeader_t)) {
+		old = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (old == MAP_FAILED) {
+			com_pwarning("initSnapshot: mmap");
+			close(fd);
+			return;
+		}
+		if (!snap_valid(old, st.st_size)) {
+			com_warning("initSnapshot: %s is not a snapshot, starting over", path);
+			munmap(old, st.st_size);
+			old = NULL;
+		}
+	}
+
+	if (old && snap_matches(old) &&
+	    st.st_size == snap_size(old->channels, old->servers, old->rosterSpace)) {
+		// Use it as it is
+		bot.snap = old;
+		bot.snapSize = st.st_size;
+		close(fd);
+		snap_restore();
+		return;
+	}
+
+	// Configuration changed
+	snap_rewrite(fd, old, st.st_size);
+	close(fd);
+	if (bot.snap)
+		snap_restore();
+}
+
+// Pickups or servers were reloaded
+void snap_reload(void)
+{
+	const char *path = botSnapshotFile;
+	int	fd;
+
+	if (!path || !bot.snap)
+		return;
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		com_pwarning(path);
+		munmap(bot.snap, bot.snapSize);
+		bot.snap = NULL;
+		return;
+	}
+	snap_rewrite(fd, bot.snap, bot.snapSize);
+	close(fd);
+	if (!bot.snap)
+		return;
+
+	bot.snapDirty = true;
+	bot.snapServers = true;
+}
+
+/* Message Parsing
+ * functions
+ */
+
+pickup_t *findPickup(const pickupNode_t *node, const char *list)
+{
+	if (!node)
+		return NULL;
+	if (!strcasecmp(list, node->pickup->name))
+		return node->pickup;
+	else
+		return findPickup(node->next, list);
+}
+
+// Reentrant replacement for strtok(s, " ")
+char *nextWord(char **cursor)
+{
+	char *word = *cursor;
+	char *end;
+
+	if (!word)
+		return NULL;
+	while (*word == ' ')
+		word++;
+	if (!*word) {
+		*cursor = NULL;
+		return NULL;
+	}
+
+	end = strchr(word, ' ');
+	if (end) {
+		*end = '\0';
+		*cursor = end + 1;
+	} else {
+		*cursor = NULL;
+	}
+	return word;
+}
+
+// Look up names from the cursor in a list of pickups
+pickupNode_t *parsePickupList(const pickupNode_t *pickups, char **cursor)
+{
+	char *item;
+	pickup_t *pickup;
+
+	item = nextWord(cursor);
+	if (!item)
+		return NULL;
+	pickup = findPickup(pickups, item);
+
+	if (pickup)
+		return pushPickup(parsePickupList(pickups, cursor), pickup);
+	else
+		return parsePickupList(pickups, cursor);
+}
+
+// Split prefix into nick, user and host in place
+void parsePrefix(char *ptr, char *end, struct prefix_s *prefix)
+{
+	char *user = memchr(ptr, '!', end - ptr);
+	char *host = memchr(user ? user : ptr, '@', end - (user ? user : ptr));
+
+	prefix->nick = ptr;
+	prefix->user = NULL;
+	prefix->host = NULL;
+	if (user) {
+		*user++ = '\0';
+		prefix->user = user;
+	}
+	if (host) {
+		*host++ = '\0';
+		prefix->host = host;
+	}
+}
+
+// Parses IRC message string with \r\n removed in a single pass over
+// the line. Returns true on sucess and false for malformed input.
+bool parseMessage(char *ptr, char *msgEnd, message_t *message)
+{
+	char *end;
+
+	*msgEnd = '\0';
+
+	message->tags = NULL;
+	message->tagsLen = 0;
+	if (*ptr == '@') {
+		end = memchr(ptr, ' ', msgEnd - ptr);
+		if (!end || end - ptr > MAX_TAGS_LEN)
+			return false;
+		*end = '\0';
+		message->tags = ptr + 1;
+		message->tagsLen = end - ptr - 1;
+		ptr = end + 1;
+		while (*ptr == ' ')
+			ptr++;
+	}
+
+	if (msgEnd - ptr > MAX_MSG_LEN - 2)
+		return false;
+
+	if (*ptr == ':') {
+		end = memchr(ptr, ' ', msgEnd - ptr);
+		if (!end)
+			return false;
+		*end = '\0';
+		parsePrefix(ptr + 1, end, &message->prefix);
+		ptr = end + 1;
+		while (*ptr == ' ')
+			ptr++;
+	} else {
+		memset(&message->prefix, 0, sizeof(message->prefix));
+	}
+
+	// Command
+	end = memchr(ptr, ' ', msgEnd - ptr);
+	if (!end)
+		end = msgEnd;
+	if (end == ptr)
+		return false;
+	*end = '\0';
+	message->command = ptr;
+	message->commandLen = end - ptr;
+	ptr = end < msgEnd ? end + 1 : msgEnd;
+
+	// <middle> parameters and <trailing>
+	message->paramCount = 0;
+	message->trailing = NULL;
+	message->trailingLen = 0;
+	while (true) {
+		while (*ptr == ' ')
+			ptr++;
+		if (!*ptr)
+			break;
+
+		if (*ptr == ':') {
+			message->trailing = ptr + 1;
+			message->trailingLen = msgEnd - ptr - 1;
+			break;
+		}
+
+		end = memchr(ptr, ' ', msgEnd - ptr);
+		if (!end)
+			end = msgEnd;
+		*end = '\0';
+		if (message->paramCount < MAX_MSG_PARAMS) {
+			message->parameter[message->paramCount] = ptr;
+			message->paramLen[message->paramCount] = end - ptr;
+			message->paramCount++;
+		}
+		ptr = end < msgEnd ? end + 1 : msgEnd;
+	}
+	message->parameter[message->paramCount] = NULL;
+
+	return true;
+}
+
+/* Dispatch tables
+ * functions
+ */
+
+// Command names of up to 7 characters are packed into an integer
+// key with the length in the top byte. Numeric replies use their
+// number as the key, which leaves the top byte clear.
+uint64_t packCommand(const char *name, int len)
+{
+	uint64_t key = 0;
+	int i;
+
+	if (len < 1 || len > 7)
+		return 0;
+
+	for (i = 0; i < len; i++)
+		key = key << 8 | (unsigned char)name[i];
+	return key | (uint64_t)len << 56;
+}
+
+unsigned dispatchSlot(uint64_t key)
+{
+	return (key * 0x9E3779B97F4A7C15ull) >> (64 - DISPATCH_TABLE_BITS);
+}
+
+void dispatchInsert(dispatchTable_t *table, uint64_t key, const void *entry)
+{
+	unsigned i = dispatchSlot(key);
+
+	assert(key);
+	while (table->keys[i]) {
+		assert(table->keys[i] != key);
+		i = (i + 1) & (DISPATCH_TABLE_SIZE - 1);
+	}
+	table->keys[i] = key;
+	table->entries[i] = entry;
+}
+
+const void *dispatchFind(const dispatchTable_t *table, uint64_t key)
+{
+	unsigned i = dispatchSlot(key);
+
+	if (!key)
+		return NULL;
+
+	while (table->keys[i]) {
+		if (table->keys[i] == key)
+			return table->entries[i];
+		i = (i + 1) & (DISPATCH_TABLE_SIZE - 1);
+	}
+	return NULL;
+}
+
+const void *dispatchLookup(const dispatchTable_t *table, const char *name, int len)
+{
+	return dispatchFind(table, packCommand(name, len));
+}
+
+/* Bot commands
+ * functions
+ */
+
+void addCommand(channel_t *channel, char *args, const char *replyTo, const char *from)
+{
+	pickupNode_t *pickupList = NULL;
+
+	if (args)
+		pickupList = parsePickupList(channel->pickupList, &args);
+	if (pickupList)
+		addNick(channel, pickupList, from);
+	else
+		printGames(channel, "Type !add <game> to sign up.");
+
+	freePickupList(pickupList);
+}
+
+void removeCommand(channel_t *channel, char *args, const char *replyTo, const char *from)
+{
+	pickupNode_t *pickupList;
+
+	if (!args) {
+		removeNick(channel->pickupList, from);
+		return;
+	}
+
+	pickupList = parsePickupList(channel->pickupList, &args);
+	if (pickupList)
+		removeNick(pickupList, from);
+	else
+		printGames(channel, "Type !remove <game> to sign off.");
+
+	freePickupList(pickupList);
+}
+
+void whoCommand(channel_t *channel, char *args, const char *replyTo, const char *from)
+{
+	pickupNode_t *pickupList;
+
+	if (botSilentWho)
+		replyTo = from;
+
+	if (!args) {
+		announcePlayers(channel->pickupList, replyTo);
+		return;
+	}
+
+	pickupList = parsePickupList(channel->pickupList, &args);
+	if (pickupList)
+		announcePlayers(pickupList, replyTo);
+	else
+		printGames(channel, "Type !who <game> to see players who signed up already.");
+
+	freePickupList(pickupList);
+}
+
+void serversCommand(channel_t *channel, char *args, const char *replyTo, const char *from)
+{
+	pickupNode_t *pickupList = NULL;
+
+	if (args)
+		pickupList = parsePickupList(channel->pickupList, &args);
+	if (pickupList)
+		announceServers(pickupList, replyTo);
+	else
+		printGames(channel, "Type !servers <game> to see recommended servers.");
+
+	freePickupList(pickupList);
+}
+
+void promoteCommand(channel_t *channel, char *args, const char *replyTo, const char *from)
+{
+	pickupNode_t *pickupList = NULL;
+
+	if (args)
+		pickupList = parsePickupList(channel->pickupList, &args);
+	if (pickupList)
+		promotePickup(pickupList);
+	else
+		printGames(channel, "Type !promote <game> to find more players.");
+
+	freePickupList(pickupList);
+}
+
+void helpCommand(channel_t *channel, char *args, const char *replyTo, const char *from)
+{
+	printHelp(channel, replyTo);
+}
+
+void versionCommand(channel_t *channel, char *args, const char *replyTo, const char *from)
+{
+	printVersion(replyTo);
+}
+
+void pingCommand(channel_t *channel, char *args, const char *replyTo, const char *from)
+{
+	bot_printf("PRIVMSG %s :!pong\r\n", replyTo);
+}
+
+void statsCommand(channel_t *channel, char *args, const char *replyTo, const char *from)
+{
+	printStats(from);
+}
+
+void reloadCommand(channel_t *channel, char *args, const char *replyTo, const char *from)
+{
+	if (reloadConfig())
+		bot_printf("PRIVMSG %s :Loaded %d pickups and %d servers.\r\n", from,
+			   bot.config.pickupCount, bot.config.serverCount);
+	else
+		bot_printf("PRIVMSG %s :Configuration wasn't reloaded, see the log.\r\n", from);
+}
+
+void topicCommand(channel_t *channel, char *args, const char *replyTo, const char *from)
+{
+	if (args) {
+		setTopic(channel, args);
+		channel->statusChanged = true;
+		bot.net->statusChanged = true;
+	}
+}
+
+// Commands in a channel are for that channel. In a query the channel
+// can be given before arguments, like !add #channel CTF.
+void commandReply(channel_t *channel, char *cmd, const char *replyTo, const char *from)
+{
+	const botCommand_t *command;
+	long long start;
+	long long end;
+	char *args;
+
+	args = strchr(cmd, ' ');
+	if (args)
 		*args++ = '\0';
 
-	if (!strcmp(cmd, "add")) {
-		if (args)
-			pickupList = parsePickupList(args);
-		if (pickupList)
-			addNick(pickupList, from);
-		else
-			printGames("Type !add <game> to sign up.");
-	} else if (!strcmp(cmd, "remove")) {
-		if (args) {
-			pickupList = parsePickupList(args);
-
-			if (pickupList)
-				removeNick(pickupList, from);
-			else
-				printGames("Type !remove <game> to sign off.");
-		} else {
-			removeNick(bot.pickupList, from);
-		}
-	} else if (!strcmp(cmd, "who")) {
-		if (botSilentWho)
-			replyTo = from;
+	command = dispatchLookup(&bot.botDispatch, cmd, strlen(cmd));
+	if (!command)
+		return;
+
+	if (!channel) {
+		if (args && args[0] == '#') {
+			channel = findChannel(nextWord(&args));
+			if (!channel)
+				return;
+		} else {
+			channel = queryChannel(findNick(from));
+		}
+	}
+
+	if (command->opOnly && !isOp(findNick(from), channel))
+		return;
+
+	start = com_nanoseconds();
+	command->handler(channel, args, replyTo, from);
+	end = com_nanoseconds();
+	hist_add(&bot.stats.botTime[command - botCommands], end - start);
+	trace_span(TT_IRC, command->name, start, end);
+}
+
+/* IRC messages
+ * functions
+ */
+
+void pingReply(message_t *message)
+{
+	if (message->trailing)
+		bot_printf("PONG :%s\r\n", message->trailing);
+	else
+		bot_puts("PONG");
+}
+
+void privmsgReply(message_t *message)
+{
+	channel_t *channel = NULL;
+	const char *replyTo;
+
+	if (!message->trailing || message->trailing[0] != '!' ||
+	    !message->prefix.nick)
+		return;
+
+	if (!strcmp(message->parameter[0], bot.net->nick)) {
+		replyTo = message->prefix.nick;
+	} else {
+		channel = findChannel(message->parameter[0]);
+		if (!channel)
+			return;
+		replyTo = channel->name;
+	}
+
+	commandReply(channel, message->trailing + 1, replyTo, message->prefix.nick);
+}
+
+// Channels are separated by commas
+void partReply(message_t *message)
+{
+	player_t *player;
+	channel_t *channel;
+	char	*cursor = message->parameter[0];
+	char	*name;
+
+	if (!message->prefix.nick)
+		return;
+
+	while ((name = strsep(&cursor, ","))) {
+		player = findNick(message->prefix.nick);
+		channel = findChannel(name);
+		if (!player || !channel)
+			continue;
+
+		if (player == bot.net->self)
+			clearChannel(channel);
+		else
+			leaveChannel(player, channel);
+	}
+}
+
+void quitReply(message_t *message)
+{
+	if (message->prefix.nick)
+		forgetNick(message->prefix.nick);
+}
+
+void kickReply(message_t *message)
+{
+	channel_t *channel = findChannel(message->parameter[0]);
+	player_t *player = findNick(message->parameter[1]);
+
+	if (!channel || !player)
+		return;
+
+	if (player == bot.net->self)
+		clearChannel(channel);
+	else
+		leaveChannel(player, channel);
+}
+
+void nickReply(message_t *message)
+{
+	if (message->prefix.nick && message->trailing)
+		changeNick(message->prefix.nick, message->trailing);
+}
+
+void joinReply(message_t *message)
+{
+	channel_t *channel;
+	player_t *player;
+
+	if (!message->prefix.nick)
+		return;
+	channel = findChannel(message->parameter[0]);
+	if (!channel)
+		return;
+
+	// Our own JOIN shows the prefix the server puts on our messages
+	if (!irc_strcasecmp(message->prefix.nick, bot.net->nick) &&
+	    message->prefix.user && message->prefix.host) {
+		bot.net->relayPrefixLen = strlen(message->prefix.nick) +
+			strlen(message->prefix.user) +
+			strlen(message->prefix.host) + 4;
+	}
+
+	player = findNick(message->prefix.nick);
+	if (!player)
+		player = registerPlayer(message->prefix.nick);
+	else if (player != bot.net->self &&
+		 (player->channels & channelBit(channel)))
+		com_warning("JOIN: Player %s was already in %s",
+			    message->prefix.nick, channel->name);
+
+	if (player)
+		player->channels |= channelBit(channel);
+}
+
+void modeReply(message_t *message)
+{
+	channel_t *channel;
+	player_t *player;
+	const char *nick;
+	bool op = false;
+	int i;
+
+	channel = findChannel(message->parameter[0]);
+	if (!channel)
+		return;
+
+	for (i = 1; message->parameter[1][i]; i++) {
+		if (message->parameter[1][i] == 'o')
+			op = true;
+	}
+	if (!op)
+		return;
+	if (message->parameter[1][0] == '-')
+		op = false;
+	else if (message->parameter[1][0] != '+')
+		return;
+
+	// There is 'o' mode so 'l' and <limit> parameters are not
+	if (message->paramCount < 3)
+		return;
+	nick = message->parameter[2];
+
+	player = findNick(nick);
+	if (!player) {
+		player = registerPlayer(nick);
+		com_warning("MODE: Player %s was not registered",
+			    nick);
+		if (!player)
+			return;
+	}
+	player->channels |= channelBit(channel);
+	setOp(player, channel, op);
+
+	if (op && player == bot.net->self) {
+		// Earlier TOPIC was refused
+		channel->sentTopic[0] = '\0';
+		channel->statusChanged = true;
+		bot.net->statusChanged = true;
+	}
+}
+
+// Join all channels in as few lines as possible
+void welcomeReply(message_t *message)
+{
+	char	line[MAX_MSG_LEN];
+	int	len = 0;
+	int	i;
+
+	bot.net->state = NET_REGISTERED;
+	bot_setOutClass(OUT_URGENT);
+	if (bot.net->qPassword) {
+		bot_printf("PRIVMSG Q@CServe.quakenet.org :AUTH %s %s\r\n",
+			   bot.net->nick, bot.net->qPassword);
+		bot_printf("MODE %s +x\r\n", bot.net->nick);
+	}
+	for (i = 0; i < bot.net->channelCount; i++) {
+		const char *name = bot.net->channels[i]->name;
+
+		if (len && len + 1 + strlen(name) > MAX_MSG_LEN - 2) {
+			bot_puts(line);
+			len = 0;
+		}
+		len += snprintf(line + len, sizeof(line) - len, len ? ",%s" : "JOIN %s",
+				name);
+	}
+	bot_puts(line);
+	bot_setOutClass(OUT_AUTO);
+}
+
+void isupportReply(message_t *message)
+{
+	int i;
+
+	for (i = 1; i < message->paramCount; i++) {
+		const char *token = message->parameter[i];
+		const char *privmsg;
+
+		if (!strncmp(token, "NICKLEN=", 8) && atoi(token + 8) > 0) {
+			setNickLen(atoi(token + 8));
+		} else if (!strncmp(token, "MAXTARGETS=", 11)) {
+			bot.net->maxTargets = atoi(token + 11);
+		} else if (!strncmp(token, "TARGMAX=", 8) &&
+			   (privmsg = strstr(token, "PRIVMSG:"))) {
+			// Empty value means no limit
+			bot.net->maxTargets = atoi(privmsg + 8);
+		}
+	}
+}
+
+void namreplyReply(message_t *message)
+{
+	channel_t *channel;
+	char *cursor;
+	const char *nick;
+
+	if (!message->trailing)
+		return;
+	channel = findChannel(message->parameter[2]);
+	if (!channel)
+		return;
+
+	cursor = message->trailing;
+	while ((nick = nextWord(&cursor))) {
+		player_t *player;
+		bool op = false;
+
+		if (nick[0] == '@') {
+			op = true;
+			nick++;
+		} else if (nick[0] == '+') {
+			nick++;
+		}
+
+		player = namePlayer(nick);
+		if (player) {
+			player->channels |= channelBit(channel);
+			player->named |= channelBit(channel);
+			setOp(player, channel, op);
+		}
+	}
+}
+
+void endofnamesReply(message_t *message)
+{
+	channel_t *channel = findChannel(message->parameter[1]);
+
+	if (channel) {
+		sweepChannel(channel);
+		snap_restoreRosters(channel);
+	}
+}
+
+// We couldn't get back into the channel, so nobody we remember from
+// it can be seen anymore
+void joinFailedReply(message_t *message)
+{
+	channel_t *channel = findChannel(message->parameter[1]);
+
+	if (channel) {
+		com_warning("Can't join %s: %s", channel->name,
+			    message->trailing ? message->trailing : "");
+		clearChannel(channel);
+	}
+}
+
+/* Command dispatch
+ * functions
+ */
+
+const ircCommand_t ircCommands[] = {
+	{ "PING",	.handler = pingReply },
+	{ "PRIVMSG",	.handler = privmsgReply,	.minParams = 1 },
+	{ "PART",	.handler = partReply,		.minParams = 1 },
+	{ "QUIT",	.handler = quitReply },
+	{ "KICK",	.handler = kickReply,		.minParams = 2 },
+	{ "NICK",	.handler = nickReply },
+	{ "JOIN",	.handler = joinReply,		.minParams = 1 },
+	{ "MODE",	.handler = modeReply,		.minParams = 2 },
+	{ .numeric = RPL_WELCOME,	.handler = welcomeReply },
+	{ .numeric = RPL_ISUPPORT,	.handler = isupportReply },
+	{ .numeric = RPL_NAMREPLY,	.handler = namreplyReply,	.minParams = 3 },
+	{ .numeric = RPL_ENDOFNAMES,	.handler = endofnamesReply,	.minParams = 2 },
+	{ .numeric = ERR_NOSUCHCHANNEL,	.handler = joinFailedReply,	.minParams = 2 },
+	{ .numeric = ERR_TOOMANYCHANNELS, .handler = joinFailedReply,	.minParams = 2 },
+	{ .numeric = ERR_CHANNELISFULL,	.handler = joinFailedReply,	.minParams = 2 },
+	{ .numeric = ERR_INVITEONLYCHAN, .handler = joinFailedReply,	.minParams = 2 },
+	{ .numeric = ERR_BANNEDFROMCHAN, .handler = joinFailedReply,	.minParams = 2 },
+	{ .numeric = ERR_BADCHANNELKEY,	.handler = joinFailedReply,	.minParams = 2 },
+	{ .numeric = ERR_NEEDREGGEDNICK, .handler = joinFailedReply,	.minParams = 2 },
+};
+
+const botCommand_t botCommands[] = {
+	{ "help",	helpCommand,	"!help, !version - print info messages" },
+	{ "version",	versionCommand },
+	{ "add",	addCommand,	"!add - Add up to a pickup game" },
+	{ "remove",	removeCommand,	"!remove - Remove yourself from all pickups" },
+	{ "who",	whoCommand,	"!who - List players added to pickups" },
+	{ "promote",	promoteCommand,	"!promote - Promote a pickup game" },
+	{ "servers",	serversCommand,	"!servers - List recommended servers" },
+	{ "ping",	pingCommand },
+	{ "topic",	topicCommand,	"!topic - Set channel topic",	.opOnly = true },
+	{ "stats",	statsCommand,	"!stats - Show bot statistics",	.opOnly = true },
+	{ "reload",	reloadCommand,	"!reload - Reload pickups and servers",	.opOnly = true },
+};
+
+// Dispatch tables stay at most half full and every entry has its
+// handler time histogram
+_Static_assert(sizeof(ircCommands) / sizeof(*ircCommands) <=
+	       sizeof(bot.stats.ircTime) / sizeof(*bot.stats.ircTime),
+	       "Too many ircCommands, raise DISPATCH_TABLE_BITS");
+_Static_assert(sizeof(botCommands) / sizeof(*botCommands) <=
+	       sizeof(bot.stats.botTime) / sizeof(*bot.stats.botTime),
+	       "Too many botCommands, raise DISPATCH_TABLE_BITS");
+
+void initCommands(void)
+{
+	int i;
+
+	for (i = 0; i < sizeof(ircCommands) / sizeof(*ircCommands); i++) {
+		const ircCommand_t *command = &ircCommands[i];
+
+		if (command->name)
+			dispatchInsert(&bot.ircDispatch,
+				       packCommand(command->name, strlen(command->name)),
+				       command);
+		else
+			dispatchInsert(&bot.ircDispatch, command->numeric, command);
+	}
+
+	for (i = 0; i < sizeof(botCommands) / sizeof(*botCommands); i++)
+		dispatchInsert(&bot.botDispatch,
+			       packCommand(botCommands[i].name, strlen(botCommands[i].name)),
+			       &botCommands[i]);
+}
+
+void printHelp(const channel_t *channel, const char *to)
+{
+	player_t *player = NULL;
+	int i;
+
+	if (irc_validateNick(to))
+		player = findNick(to);
+
+	bot_printf("PRIVMSG %s :You can type commands in the main channel or query the bot.\r\n", to);
+	for (i = 0; i < sizeof(botCommands) / sizeof(*botCommands); i++) {
+		const botCommand_t *command = &botCommands[i];
+
+		if (!command->help)
+			continue;
+		if (command->opOnly && !isOp(player, channel))
+			continue;
+		bot_printf("PRIVMSG %s :%s\r\n", to, command->help);
+	}
+}
+
+void printStats(const char *to)
+{
+	const stats_t *stats = &bot.stats;
+	linePacker_t lp;
+	int i;
+
+	lp_begin(&lp, to, ", ");
+	lp_text(&lp, "Up %lds: ", (long)(time(NULL) - stats->started));
+	lp_item(&lp, "in %llu msgs %llu B", (unsigned long long)stats->messagesIn,
+		(unsigned long long)stats->bytesIn);
+	lp_item(&lp, "out %llu lines %llu B", (unsigned long long)stats->linesOut,
+		(unsigned long long)stats->bytesOut);
+	lp_item(&lp, "%llu parse errors", (unsigned long long)stats->parseErrors);
+	lp_item(&lp, "%llu dropped", (unsigned long long)stats->outputDropped);
+	lp_item(&lp, "%llu reconnects", (unsigned long long)stats->reconnects);
+	lp_item(&lp, "queue %d lines, p99 < %lld", bot.net->outLines,
+		hist_quantile(&stats->queueDepth, 0.99));
+	lp_item(&lp, "queries %llu sent %llu replies %llu timeouts, rtt avg %lld ms p99 < %lld ms",
+		(unsigned long long)stats->queriesSent,
+		(unsigned long long)stats->queryReplies,
+		(unsigned long long)stats->queryTimeouts,
+		hist_mean(&stats->queryRtt), hist_quantile(&stats->queryRtt, 0.99));
+	lp_flush(&lp);
+
+	// Handler times in nanoseconds
+	lp_text(&lp, "avg/p99 ns: ");
+	lp_item(&lp, "parse %lld/%lld", hist_mean(&stats->parseTime),
+		hist_quantile(&stats->parseTime, 0.99));
+	for (i = 0; i < sizeof(ircCommands) / sizeof(*ircCommands); i++) {
+		const histogram_t *hist = &stats->ircTime[i];
+
+		if (!hist->count)
+			continue;
+		if (ircCommands[i].name)
+			lp_item(&lp, "%s %lld/%lld", ircCommands[i].name,
+				hist_mean(hist), hist_quantile(hist, 0.99));
+		else
+			lp_item(&lp, "%03d %lld/%lld", ircCommands[i].numeric,
+				hist_mean(hist), hist_quantile(hist, 0.99));
+	}
+	for (i = 0; i < sizeof(botCommands) / sizeof(*botCommands); i++) {
+		const histogram_t *hist = &stats->botTime[i];
+
+		if (hist->count)
+			lp_item(&lp, "!%s %lld/%lld", botCommands[i].name,
+				hist_mean(hist), hist_quantile(hist, 0.99));
+	}
+	lp_flush(&lp);
+}
+
+// Write histogram in Prometheus text format scaling values by scale
+void writeHistogram(FILE *f, const char *name, const char *labels,
+		    const histogram_t *hist, double scale)
+{
+	uint64_t cumulative = 0;
+	const char *sep = *labels ? "," : "";
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		cumulative += hist->buckets[i];
+		fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+			(double)(1ULL << i) * scale, (unsigned long long)cumulative);
+	}
+	fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+		(unsigned long long)hist->count);
+	if (*labels) {
+		fprintf(f, "%s_sum{%s} %g\n", name, labels, hist->sum * scale);
+		fprintf(f, "%s_count{%s} %llu\n", name, labels,
+			(unsigned long long)hist->count);
+	} else {
+		fprintf(f, "%s_sum %g\n", name, hist->sum * scale);
+		fprintf(f, "%s_count %llu\n", name, (unsigned long long)hist->count);
+	}
+}
+
+void writeCounter(FILE *f, const char *name, const char *help, uint64_t value)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+		name, help, name, name, (unsigned long long)value);
+}
+
+// Rewrite botMetricsFile so that readers never see it half-written
+void writeMetrics(evtimer_t *timer)
+{
+	const stats_t *stats = &bot.stats;
+	const char *path = botMetricsFile;
+	char	tmpPath[256];
+	char	labels[64];
+	FILE	*f;
+	int	i;
+
+	if (!path)
+		return;
+
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+	f = fopen(tmpPath, "w");
+	if (!f) {
+		com_pwarning(tmpPath);
+		return;
+	}
+
+	fprintf(f, "# HELP jk2pugbot_start_time_seconds Start time since the epoch.\n"
+		"# TYPE jk2pugbot_start_time_seconds gauge\n"
+		"jk2pugbot_start_time_seconds %ld\n", (long)stats->started);
+	writeCounter(f, "jk2pugbot_messages_received_total",
+		     "IRC messages received.", stats->messagesIn);
+	writeCounter(f, "jk2pugbot_received_bytes_total",
+		     "Bytes of IRC messages received.", stats->bytesIn);
+	writeCounter(f, "jk2pugbot_parse_errors_total",
+		     "IRC messages that failed to parse.", stats->parseErrors);
+	writeCounter(f, "jk2pugbot_lines_sent_total",
+		     "Lines sent to the IRC server.", stats->linesOut);
+	writeCounter(f, "jk2pugbot_sent_bytes_total",
+		     "Bytes sent to the IRC server.", stats->bytesOut);
+	writeCounter(f, "jk2pugbot_output_dropped_total",
+		     "Lines dropped because output queues were full.",
+		     stats->outputDropped);
+	writeCounter(f, "jk2pugbot_reconnects_total",
+		     "Reconnects to the IRC server.", stats->reconnects);
+	writeCounter(f, "jk2pugbot_queries_sent_total",
+		     "Game server queries sent.", stats->queriesSent);
+	writeCounter(f, "jk2pugbot_query_replies_total",
+		     "Game server query replies.", stats->queryReplies);
+	writeCounter(f, "jk2pugbot_query_timeouts_total",
+		     "Game server queries that timed out.", stats->queryTimeouts);
+	fprintf(f, "# HELP jk2pugbot_output_queue_lines Lines waiting for flood control.\n"
+		"# TYPE jk2pugbot_output_queue_lines gauge\n");
+	for (i = 0; i < bot.networkCount; i++)
+		fprintf(f, "jk2pugbot_output_queue_lines{network=\"%s\"} %d\n",
+			bot.networks[i].name, bot.networks[i].outLines);
+
+	fprintf(f, "# HELP jk2pugbot_parse_seconds Time spent parsing an IRC message.\n"
+		"# TYPE jk2pugbot_parse_seconds histogram\n");
+	writeHistogram(f, "jk2pugbot_parse_seconds", "", &stats->parseTime, 1e-9);
+
+	fprintf(f, "# HELP jk2pugbot_handler_seconds Time spent handling an IRC message.\n"
+		"# TYPE jk2pugbot_handler_seconds histogram\n");
+	for (i = 0; i < sizeof(ircCommands) / sizeof(*ircCommands); i++) {
+		if (ircCommands[i].name)
+			snprintf(labels, sizeof(labels), "command=\"%s\"", ircCommands[i].name);
+		else
+			snprintf(labels, sizeof(labels), "command=\"%03d\"", ircCommands[i].numeric);
+		writeHistogram(f, "jk2pugbot_handler_seconds", labels,
+			       &stats->ircTime[i], 1e-9);
+	}
+
+	fprintf(f, "# HELP jk2pugbot_command_seconds Time spent handling a bot command.\n"
+		"# TYPE jk2pugbot_command_seconds histogram\n");
+	for (i = 0; i < sizeof(botCommands) / sizeof(*botCommands); i++) {
+		snprintf(labels, sizeof(labels), "command=\"%s\"", botCommands[i].name);
+		writeHistogram(f, "jk2pugbot_command_seconds", labels,
+			       &stats->botTime[i], 1e-9);
+	}
+
+	fprintf(f, "# HELP jk2pugbot_query_rtt_seconds Game server query round trip time.\n"
+		"# TYPE jk2pugbot_query_rtt_seconds histogram\n");
+	writeHistogram(f, "jk2pugbot_query_rtt_seconds", "", &stats->queryRtt, 1e-3);
+
+	fprintf(f, "# HELP jk2pugbot_queue_depth_lines Lines already waiting when one is queued.\n"
+		"# TYPE jk2pugbot_queue_depth_lines histogram\n");
+	writeHistogram(f, "jk2pugbot_queue_depth_lines", "", &stats->queueDepth, 1);
+
+	if (fclose(f)) {
+		com_pwarning(tmpPath);
+		return;
+	}
+	if (rename(tmpPath, path))
+		com_pwarning(path);
+}
+
+void initMetrics(void)
+{
+	bot.stats.started = time(NULL);
+	if (!botMetricsFile)
+		return;
+
+	ev_timerInit(&bot.metricsTimer, writeMetrics);
+	ev_timerSet(&bot.metricsTimer, botMetricsInterval * 1000LL,
+		    botMetricsInterval * 1000LL);
+}
+
+#ifdef DEBUG_BENCHMARK
+void printHandlerTime(const char *name, const histogram_t *hist, long long elapsed)
+{
+	if (hist->count)
+		log_printf(LL_INFO, "  %-10s %10llu calls %10lld ns/call %6.2f%%", name,
+			   (unsigned long long)hist->count, hist_mean(hist),
+			   100.0 * hist->sum / elapsed);
+}
+
+// Report replay throughput and where the time went
+void printBenchmark(void)
+{
+	const stats_t *stats = &bot.stats;
+	long long elapsed = com_nanoseconds() - bot.benchStart;
+	struct rusage usage;
+	char	name[16];
+	int	i;
+
+	getrusage(RUSAGE_SELF, &usage);
+	log_printf(LL_INFO, "%llu messages, %llu bytes in %.3f s: %.0f msgs/s",
+		   (unsigned long long)stats->messagesIn,
+		   (unsigned long long)stats->bytesIn, elapsed / 1e9,
+		   stats->messagesIn * 1e9 / elapsed);
+	log_printf(LL_INFO, "%llu lines out, %llu parse errors, peak RSS %ld KiB",
+		   (unsigned long long)stats->linesOut,
+		   (unsigned long long)stats->parseErrors, usage.ru_maxrss);
+
+	printHandlerTime("parse", &stats->parseTime, elapsed);
+	for (i = 0; i < sizeof(ircCommands) / sizeof(*ircCommands); i++) {
+		if (ircCommands[i].name)
+			snprintf(name, sizeof(name), "%s", ircCommands[i].name);
+		else
+			snprintf(name, sizeof(name), "%03d", ircCommands[i].numeric);
+		printHandlerTime(name, &stats->ircTime[i], elapsed);
+	}
+	for (i = 0; i < sizeof(botCommands) / sizeof(*botCommands); i++) {
+		snprintf(name, sizeof(name), "!%s", botCommands[i].name);
+		printHandlerTime(name, &stats->botTime[i], elapsed);
+	}
+}
+#endif
+
+void messageReply(message_t *message)
+{
+	const ircCommand_t *command;
+	const char *cmd = message->command;
+
+	if (message->commandLen == 3 && irc_isdigit(cmd[0]) &&
+	    irc_isdigit(cmd[1]) && irc_isdigit(cmd[2])) {
+		// Numeric replies are only interesting if they are for us
+		if (!message->paramCount || strcmp(message->parameter[0], bot.net->nick))
+			return;
+
+		command = dispatchFind(&bot.ircDispatch, (cmd[0] - '0') * 100 +
+				       (cmd[1] - '0') * 10 + (cmd[2] - '0'));
+	} else {
+		command = dispatchLookup(&bot.ircDispatch, cmd, message->commandLen);
+	}
+
+	if (command && message->paramCount >= command->minParams) {
+		long long start = com_nanoseconds();
+		long long end;
+
+		command->handler(message);
+		end = com_nanoseconds();
+		hist_add(&bot.stats.ircTime[command - ircCommands], end - start);
+		trace_span(TT_IRC, message->command, start, end);
+	}
+}
+
+/* Configuration
+ * functions
+ */
 
-		if (args) {
-			pickupList = parsePickupList(args);
+// Split off the next field of a configuration line
+char *cfg_field(char **cursor)
+{
+	char *field = *cursor + strspn(*cursor, " \t\r");
+	char *end;
 
-			if (pickupList)
-				announcePlayers(pickupList, replyTo);
-			else
-				printGames("Type !who <game> to see players who signed up already.");
-		} else {
-			announcePlayers(bot.pickupList, replyTo);
+	if (!*field)
+		return NULL;
+	end = field + strcspn(field, " \t\r");
+	*cursor = *end ? end + 1 : end;
+	*end = '\0';
+	return field;
+}
+
+// The rest of a configuration line without surrounding blanks
+char *cfg_rest(char **cursor)
+{
+	char *rest = *cursor + strspn(*cursor, " \t\r");
+	char *end = rest + strlen(rest);
+
+	while (end > rest && strchr(" \t\r", end[-1]))
+		end--;
+	*end = '\0';
+	*cursor = end;
+	return *rest ? rest : NULL;
+}
+
+pickup_t *cfg_pickup(config_t *config)
+{
+	config->pickups = com_realloc(config->pickups,
+				      (config->pickupCount + 1) * sizeof(pickup_t));
+	memset(&config->pickups[config->pickupCount], 0, sizeof(pickup_t));
+	return &config->pickups[config->pickupCount++];
+}
+
+server_t *cfg_server(config_t *config)
+{
+	config->servers = com_realloc(config->servers,
+				      (config->serverCount + 1) * sizeof(server_t));
+	memset(&config->servers[config->serverCount], 0, sizeof(server_t));
+	return &config->servers[config->serverCount++];
+}
+
+// Parse one line in place. Returns what's wrong with it or NULL.
+const char *cfg_line(config_t *config, char *line)
+{
+	char	*keyword = cfg_field(&line);
+	char	*end;
+	int	i;
+
+	if (!keyword || keyword[0] == '#')
+		return NULL;
+
+	if (!strcmp(keyword, "pickup")) {
+		// pickup <name> <max players or 0>
+		char *name = cfg_field(&line);
+		char *max = cfg_field(&line);
+		pickup_t *pickup;
+		long value;
+
+		if (!max || cfg_field(&line))
+			return "expected pickup <name> <max players>";
+		value = strtol(max, &end, 10);
+		if (*end || value < 0 || value > botMaxPlayers)
+			return "bad number of players";
+		for (i = 0; i < config->pickupCount; i++) {
+			if (!strcasecmp(config->pickups[i].name, name))
+				return "pickup defined twice";
 		}
-	} else if (!strcmp(cmd, "servers")) {
-		if (args)
-			pickupList = parsePickupList(args);
-		if (pickupList)
-			announceServers(pickupList, replyTo);
-		else
-			printGames("Type !servers <game> to see recommended servers.");
-	}else if (!strcmp(cmd, "promote")) {
-		if (args)
-			pickupList = parsePickupList(args);
-		if (pickupList)
-			promotePickup(pickupList);
-		else
-			printGames("Type !promote <game> to find more players.");
-	} else if (!strcmp(cmd, "help")) {
-		printHelp(replyTo);
-	} else if (!strcmp(cmd, "version")) {
-		printVersion(replyTo);
-	} else if (!strcmp(cmd, "ping")) {
-		bot_printf("PRIVMSG %s :!pong\r\n", replyTo);
-	} else if (!strcmp(cmd, "topic")) {
-		player_t *player = findNick(from);
-
-		if (args && player && player->op) {
-			setTopic(args);
-			bot.statusChanged = true;
+		pickup = cfg_pickup(config);
+		pickup->name = name;
+		pickup->max = value;
+	} else if (!strcmp(keyword, "server")) {
+		// server <address> <port> <q3|none> <pickup,...> <name>
+		server_t *server = cfg_server(config);
+		char *type;
+		char *games;
+
+		server->address = cfg_field(&line);
+		server->port = cfg_field(&line);
+		type = cfg_field(&line);
+		games = cfg_field(&line);
+		server->name = cfg_rest(&line);
+		if (!server->name)
+			return "expected server <address> <port> <q3|none> <pickups> <name>";
+		if (!strcmp(type, "q3"))
+			server->type = SV_Q3;
+		else if (strcmp(type, "none"))
+			return "server type is neither q3 nor none";
+		for (end = games; *end; end++) {
+			if (*end == ',')
+				*end = ' ';
+		}
+		server->games = games;
+	} else if (!strcmp(keyword, "channel")) {
+		// channel <network> <channel> [pickups...]
+		char *network = cfg_field(&line);
+		char *name = cfg_field(&line);
+		char *games = cfg_rest(&line);
+
+		if (!name)
+			return "expected channel <network> <channel> <pickups>";
+		for (i = 0; i < sizeof(channelsArray) / sizeof(*channelsArray); i++) {
+			if (!strcmp(channelsArray[i].network, network) &&
+			    !irc_strcasecmp(channelsArray[i].name, name))
+				break;
+		}
+		if (i == sizeof(channelsArray) / sizeof(*channelsArray))
+			return "channel isn't in channelsArray";
+		if (!config->games) {
+			config->games = calloc(sizeof(channelsArray) / sizeof(*channelsArray),
+					       sizeof(const char *));
+			if (!config->games)
+				com_perror("calloc");
 		}
+		config->games[i] = games ? games : "";
+	} else {
+		return "unknown keyword";
 	}
+	return NULL;
+}
 
-	freePickupList(pickupList);
+void freeConfig(config_t *config)
+{
+	serverNode_t *node;
+	serverNode_t *next;
+	int	i;
+
+	for (i = 0; i < config->pickupCount; i++) {
+		for (node = config->pickups[i].serverList; node; node = next) {
+			next = node->next;
+			free(node);
+		}
+		config->pickups[i].serverList = NULL;
+	}
+	if (config->text) {
+		free(config->text);
+		free(config->pickups);
+		free(config->servers);
+		free(config->games);
+	}
+	memset(config, 0, sizeof(*config));
 }
 
-void numericReplyReply(int num, message_t *message)
+// Resolver thread might still be using some of the servers
+bool configBusy(const config_t *config)
 {
-	const char *nick;
+	int	i;
 
-	if (!message->parameter[0] || strcmp(message->parameter[0], botNick))
-		return;
+	for (i = 0; i < config->serverCount; i++) {
+		if (config->servers[i].resolve.busy)
+			return true;
+	}
+	return false;
+}
 
-	switch (num) {
-	case RPL_WELCOME:
-		if (botQpassword) {
-			bot_printf("PRIVMSG Q@CServe.quakenet.org :AUTH %s %s\r\n",
-				   botNick, botQpassword);
-			bot_printf("MODE %s +x\r\n", botNick);
+// Read pickups, servers and pickups of channels from the file. On
+// error config is left empty.
+bool loadConfig(const char *path, config_t *config)
+{
+	struct stat st;
+	const char *error;
+	char	*line;
+	char	*next;
+	int	lineNum = 0;
+	int	fd;
+
+	memset(config, 0, sizeof(*config));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st)) {
+		com_pwarning(path);
+		if (fd != -1)
+			close(fd);
+		return false;
+	}
+	config->text = com_malloc(st.st_size + 1);
+	if (read(fd, config->text, st.st_size) != st.st_size) {
+		com_pwarning(path);
+		close(fd);
+		freeConfig(config);
+		return false;
+	}
+	close(fd);
+	config->text[st.st_size] = '\0';
+
+	for (line = config->text; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		lineNum++;
+
+		if ((error = cfg_line(config, line))) {
+			com_warning("%s:%d: %s", path, lineNum, error);
+			freeConfig(config);
+			return false;
 		}
-		bot_printf("JOIN %s\r\n", botChannel);
-		break;
-	case RPL_NAMREPLY:
-		if (!message->parameter[2] ||
-		    irc_strcasecmp(message->parameter[2], botChannel))
+	}
+	return true;
+}
+
+// Pickups are matched to the old ones by name. Those still there keep
+// their rosters and get new settings, players leave the removed ones.
+void setChannelPickups(channel_t *channel, const pickupNode_t *templates,
+		       const char *games)
+{
+	pickupNode_t *old = channel->pickupList;
+	pickupNode_t *pickupList;
+	pickupNode_t *node;
+	char	*names = com_strdup(games);
+	char	*cursor = names;
+	int	id = 0;
+
+	channel->pickupList = NULL;
+	pickupList = parsePickupList(templates, &cursor);
+	for (node = pickupList; node; node = node->next) {
+		pickup_t *pickup;
+
+		if (findPickup(channel->pickupList, node->pickup->name))
+			continue;
+		if (id == MAX_PICKUPS) {
+			com_warning("setChannelPickups: Too many pickups in %s, at most %d supported",
+				    channel->name, MAX_PICKUPS);
 			break;
+		}
 
-		nick = strtok(message->trailing, " ");
-		while (nick) {
-			player_t *player;
-			bool op = false;
+		pickup = findPickup(old, node->pickup->name);
+		if (!pickup) {
+			pickup = com_malloc(sizeof(pickup_t));
+			*pickup = *node->pickup;
+			pickup->channel = channel;
+		}
+		pickup->name = node->pickup->name;
+		pickup->serverList = node->pickup->serverList;
+		pickup->max = node->pickup->max;
+		pickup->id = id++;
+		updatePickupStatus(pickup);
+		channel->pickupList = pushPickup(channel->pickupList, pickup);
+	}
+	freePickupList(pickupList);
+	free(names);
+
+	for (node = old; node; node = node->next) {
+		pickup_t *pickup = node->pickup;
+
+		if (findPickup(channel->pickupList, pickup->name) == pickup)
+			continue;
+		while (pickup->playerList)
+			leavePickup(pickup->playerList);
+		channel->statusChanged = true;
+		channel->net->statusChanged = true;
+		free(pickup);
+	}
+	freePickupList(old);
+}
 
-			if (nick[0] == '@') {
-				op = true;
-				nick++;
-			} else if (nick[0] == '+') {
-				nick++;
-			}
+// Pickup ids changed, set players' bits again
+void updatePlayerPickups(void)
+{
+	member_t *member;
+	unsigned i;
 
-			player = findNick(nick);
-			if (player)
-				player->op = op;
-			else
-				registerPlayer(nick, op);
+	for (i = 0; i < bot.net->players.size; i++) {
+		player_t *player = bot.net->players.slots[i];
 
-			nick = strtok(NULL, " ");
-		}
-		break;
+		if (!player)
+			continue;
+		player->pickups = 0;
+		for (member = player->memberships; member; member = member->nextMembership)
+			player->pickups |= 1u << member->pickup->id;
 	}
 }
 
-void messageReply(message_t *message)
+// Switch to new pickups and servers. The previous ones are retired
+// until the next switch.
+void applyConfig(config_t *config)
 {
-	if (!strcmp(message->command, "PING")) {
-		if (message->trailing)
-			bot_printf("PONG :%s\r\n", message->trailing);
-		else
-			bot_puts("PONG");
-	} else if (!strcmp(message->command, "PRIVMSG")) {
-		if (message->trailing && message->trailing[0] == '!' &&
-			message->parameter[0] && message->prefix.nick) {
-			const char *replyTo;
-
-			if (!strcmp(message->parameter[0], botNick))
-				replyTo = message->prefix.nick;
-			else
-				replyTo = botChannel;
-
-			privmsgReply(message->trailing + 1,
-				     replyTo,
-				     message->prefix.nick);
-		}
-	} else if (!strcmp(message->command, "PART") ||
-		   !strcmp(message->command, "QUIT")) {
-		if (message->prefix.nick)
-			forgetNick(message->prefix.nick);
-	} else if (!strcmp(message->command, "KICK")) {
-		if (message->parameter[0] && message->parameter[1] &&
-		    !irc_strcasecmp(message->parameter[0], botChannel))
-			forgetNick(message->parameter[1]);
-	} else if (!strcmp(message->command, "NICK")) {
-		if (message->prefix.nick && message->trailing)
-			changeNick(message->prefix.nick, message->trailing);
-	} else if (!strcmp(message->command, "JOIN")) {
-		if (message->prefix.nick && message->parameter[0] &&
-		    !irc_strcasecmp(message->parameter[0], botChannel)) {
-			if (findNick(message->prefix.nick))
-				com_warning("JOIN: Player %s was already registered",
-					    message->prefix.nick);
-			else
-				registerPlayer(message->prefix.nick, false);
+	pickupNode_t *templates = NULL;
+	pickupNode_t *pickupList;
+	pickupNode_t *node;
+	char	*names;
+	char	*cursor;
+	int	i;
+	int	j;
+
+	// They point to pickups and servers
+	finishAnnouncements();
+
+	for (i = 0; i < config->pickupCount; i++)
+		templates = pushPickup(templates, &config->pickups[i]);
+
+	for (i = 0; i < config->serverCount; i++) {
+		server_t *server = &config->servers[i];
+
+		server->resolve.host = server->address;
+		server->resolve.port = server->port;
+		server->resolve.socktype = SOCK_DGRAM;
+		server->resolve.done = serverResolved;
+		server->resolve.ctx = server;
+		server->snapId = i;
+
+		// Keep the address and status we know
+		for (j = 0; j < bot.serverCount; j++) {
+			const server_t *old = &bot.servers[j];
+
+			if (strcmp(old->address, server->address) ||
+			    strcmp(old->port, server->port))
+				continue;
+			server->resolve.resolved = old->resolve.resolved;
+			server->resolve.addr = old->resolve.addr;
+			server->resolve.updated = old->resolve.updated;
+			server->info = old->info;
+			server->status = old->status;
+			server->updated = old->updated;
+			server->queryDeadline = old->queryDeadline;
+			break;
 		}
-	} else if (!strcmp(message->command, "MODE")) {
-		if (message->parameter[0] && message->parameter[1] &&
-		    !irc_strcasecmp(message->parameter[0], botChannel)) {
-			player_t *player;
-			const char *nick;
-			bool op = false;
-			int i;
 
-			for (i = 1; message->parameter[1][i]; i++) {
-				if (message->parameter[1][i] == 'o')
-					op = true;
-			}
-			if (!op)
-				return;
-			if (message->parameter[1][0] == '-')
-				op = false;
-			else if (message->parameter[1][0] != '+')
-				return;
+		names = com_strdup(server->games);
+		cursor = names;
+		pickupList = parsePickupList(templates, &cursor);
+		addServer(pickupList, server);
+		freePickupList(pickupList);
+		free(names);
+	}
+	bot.servers = config->servers;
+	bot.serverCount = config->serverCount;
 
-			// There is 'o' mode so 'l' and <limit> parameters are not
-			nick = message->parameter[2];
-			if (!nick)
-				return;
+	for (i = 0; i < sizeof(channelsArray) / sizeof(*channelsArray); i++) {
+		const char *games = config->games && config->games[i] ?
+			config->games[i] : channelsArray[i].games;
 
-			player = findNick(nick);
-			if (player) {
-				player->op = op;
-			} else {
-				player = registerPlayer(nick, op);
-				com_warning("MODE: Player %s was not registered",
-					    nick);
-			}
+		setChannelPickups(&channelsArray[i], templates, games);
+	}
+	freePickupList(templates);
 
-			if (op && player == bot.self)
-				bot.statusChanged = true;
-		}
-	} else {
-		// Determine numeric reply number
-		int num = 0;
-		for (int i = 0; i < 3; i++) {
-			if (message->command[i] >= '0' && message->command[i] <= '9') {
-				num *= 10;
-				num += message->command[i] - '0';
-			} else {
-				return;
-			}
+	for (i = 0; i < bot.networkCount; i++) {
+		bot.net = &bot.networks[i];
+		updatePlayerPickups();
+	}
+
+	// Pickups that got smaller might be full now
+	for (i = 0; i < sizeof(channelsArray) / sizeof(*channelsArray); i++) {
+		for (node = channelsArray[i].pickupList; node; node = node->next) {
+			pickup_t *pickup = node->pickup;
+
+			bot.net = channelsArray[i].net;
+			while (pickup->max && pickup->count >= pickup->max)
+				startOldestPlayers(pickup);
 		}
+	}
+
+	freeConfig(&bot.retired);
+	bot.retired = bot.config;
+	bot.config = *config;
+}
 
-		numericReplyReply(num, message);
+// Returns false if the configuration was left as it was
+bool reloadConfig(void)
+{
+	const char *path = botConfigFile;
+	network_t *net = bot.net;
+	config_t config;
+
+	if (!path) {
+		com_warning("reloadConfig: No configuration file");
+		return false;
+	}
+	if (configBusy(&bot.retired)) {
+		com_warning("reloadConfig: Previous servers are still being looked up");
+		return false;
 	}
+	if (!loadConfig(path, &config))
+		return false;
+
+	applyConfig(&config);
+	snap_reload();
+	bot.net = net;
+	log_printf(LL_INFO, "Loaded %d pickups and %d servers from %s",
+		   bot.config.pickupCount, bot.config.serverCount, path);
+	return true;
 }
 
 void initPickups()
 {
-	pickupNode_t *pickupList;
-	char *games;
+	const char *path = botConfigFile;
+	config_t config = {
+		.pickups	= pickupsArray,
+		.pickupCount	= sizeof(pickupsArray) / sizeof(*pickupsArray),
+		.servers	= serversArray,
+		.serverCount	= sizeof(serversArray) / sizeof(*serversArray),
+	};
 	int i;
 
-	for (i = 0; i < sizeof(pickupsArray) / sizeof(*pickupsArray); i++)
-		bot.pickupList = pushPickup(bot.pickupList, &pickupsArray[i]);
+	pool_init(&bot.memberPool, sizeof(member_t), SLAB_OBJS, 0);
+	if (path && !loadConfig(path, &config))
+		com_error("initPickups: Can't load %s", path);
+
+	for (i = 0; i < sizeof(channelsArray) / sizeof(*channelsArray); i++) {
+		channel_t *channel = &channelsArray[i];
+		network_t *net = findNetwork(channel->network);
+
+		if (!net)
+			com_error("initPickups: %s is on unknown network %s",
+				  channel->name, channel->network);
+		if (net->channelCount == MAX_CHANNELS)
+			com_error("initPickups: Up to %d channels per network supported",
+				  MAX_CHANNELS);
+
+		net->channels = com_realloc(net->channels,
+					    (net->channelCount + 1) * sizeof(channel_t *));
+		channel->net = net;
+		channel->id = net->channelCount;
+		channel->snapId = i;
+		net->channels[net->channelCount++] = channel;
+		setTopic(channel, botTopic);
+	}
+	applyConfig(&config);
 
-	for (i = 0; i < sizeof(serversArray) / sizeof(*serversArray); i++) {
-		games = com_strdup(serversArray[i].games);
-		pickupList = parsePickupList(games);
-		addServer(pickupList, &serversArray[i]);
-		freePickupList(pickupList);
-		free(games);
+	for (i = 0; i < bot.networkCount; i++) {
+		if (!bot.networks[i].channelCount)
+			com_error("initPickups: Network %s has no channels",
+				  bot.networks[i].name);
 	}
 }
 
 void printLists()
 {
 #ifndef NDEBUG
-	if(bot.playerList) {
-		bot_flush();
-		printf("bot.playerList = ");
-		printPlayers(bot.playerList, "->", true);
-		*bot.cursor = '\0';
-		puts(bot.sbuf);
-		bot.cursor = bot.sbuf;
+	unsigned i;
+	char	*list;
+	char	*cursor;
+
+	if (botLogLevel > LL_DEBUG || !bot.net->players.count)
+		return;
+
+	cursor = list = com_malloc(bot.net->players.count * (bot.net->nickLen + 2) + 1);
+	for (i = 0; i < bot.net->players.size; i++) {
+		player_t *player = bot.net->players.slots[i];
+
+		if (player)
+			cursor += sprintf(cursor, " %s%s", player->ops ? "@" : "",
+					  player->nick);
 	}
+	log_printf(LL_DEBUG, "%s players =%s", bot.net->name, list);
+	free(list);
 #endif
 }
 
-int main()
+/* Line buffer
+ * functions
+ */
+
+void lb_reset(lineBuffer_t *lb)
+{
+	lb->head = lb->scan = lb->tail = 0;
+	lb->discard = false;
+}
+
+// Return where to read more data and how much fits. The unfinished
+// line is moved to the front only when there's no room after it.
+char *lb_space(lineBuffer_t *lb, int *space)
 {
-	char buf[RECV_BUF_SIZE];
-	message_t message;
+	if (lb->head == lb->tail) {
+		lb->head = lb->scan = lb->tail = 0;
+	} else if (lb->tail == sizeof(lb->data) && lb->head > 0) {
+		int len = lb->tail - lb->head;
+
+		memmove(lb->data, lb->data + lb->head, len);
+		lb->scan -= lb->head;
+		lb->tail = len;
+		lb->head = 0;
+	}
 
-	struct addrinfo hints;
-	struct addrinfo *res = NULL;
+	*space = sizeof(lb->data) - lb->tail;
+	assert(*space > 0);
+	return lb->data + lb->tail;
+}
+
+// Return the next complete line and set *end past its last character.
+// Both "\r\n" and bare "\n" terminate a line. Lines longer than
+// MAX_LINE_LEN are skipped up to the next terminator.
+char *lb_nextLine(lineBuffer_t *lb, char **end)
+{
+	char	*start;
+	char	*nl;
+
+	while (true) {
+		start = lb->data + lb->head;
+		nl = memchr(lb->data + lb->scan, '\n', lb->tail - lb->scan);
+
+		if (!nl) {
+			lb->scan = lb->tail;
+			if (lb->discard) {
+				lb->head = lb->scan = lb->tail = 0;
+			} else if (lb->tail - lb->head > MAX_LINE_LEN) {
+				com_warning("Dropping oversize line");
+				lb->discard = true;
+				lb->head = lb->scan = lb->tail = 0;
+			}
+			return NULL;
+		}
+
+		lb->head = lb->scan = nl + 1 - lb->data;
+		if (lb->discard) {
+			lb->discard = false;
+			continue;
+		}
+
+		*end = nl;
+		if (*end > start && (*end)[-1] == '\r')
+			(*end)--;
+		if (*end - start > MAX_LINE_LEN) {
+			com_warning("Dropping oversize line");
+			continue;
+		}
+		if (*end > start)
+			return start;
+	}
+}
+
+/* IRC connection
+ * functions
+ */
+
+void ircConnect(void);
+
+void ircDisconnect(void)
+{
+	int i;
+
+	ev_timerSet(&bot.net->pingTimer, 0, 0);
+	ev_del(&bot.net->connEv);
+#ifndef DEBUG_INTERCEPT
+	close(bot.net->conn);
+#endif
+	bot.net->conn = -1;
+	bot.net->connEv.fd = -1;
+	bot.net->state = NET_IDLE;
+	bot.net->writePending = false;
+	bot.net->cursor = bot.net->sbuf;
+	sq_clear(&bot.net->sendq);
+	for (i = 0; i < OUT_CLASSES; i++)
+		sq_clear(&bot.net->outq[i]);
+	bot.net->outLines = 0;
+	bot.net->floodClock = 0;
+	ev_timerSet(&bot.net->floodTimer, 0, 0);
+	bot.net->statusChanged = false;
+	for (i = 0; i < bot.net->channelCount; i++) {
+		bot.net->channels[i]->statusChanged = false;
+		bot.net->channels[i]->statusDue = 0;
+		bot.net->channels[i]->statusDeadline = 0;
+		bot.net->channels[i]->sentTopic[0] = '\0';
+		bot.net->channels[i]->snapSynced = false;
+	}
+	// A NAMES burst cut short must not vouch for anyone next time
+	for (i = 0; i < bot.net->players.size; i++) {
+		if (bot.net->players.slots[i])
+			bot.net->players.slots[i]->named = 0;
+	}
+	ev_timerSet(&bot.net->statusTimer, 0, 0);
+	lb_reset(&bot.net->recv);
+	freeAnnouncements(bot.net);
+}
 
-	fd_set	set;
-	struct timeval timeout;
+// Drop the connection and try again after delay seconds
+void ircReconnect(int delay)
+{
+	ircDisconnect();
+	bot.stats.reconnects++;
+#ifdef DEBUG_BENCHMARK
+	printBenchmark();
+#endif
+#ifdef DEBUG_INTERCEPT
+	// Nothing to reconnect to
+	exit(EXIT_SUCCESS);
+#endif
+	ev_timerSet(&bot.net->reconnectTimer, delay * 1000LL + 1, 0);
+}
+
+void ircRead(void)
+{
+	message_t message;
 	int	retVal;
-	int	msgLen;
-	char	*bufEnd;
+	int	space;
+	char	*buf;
 	char	*msgStart;
 	char	*msgEnd;
 
-	struct sigaction act = {
-		.sa_handler	= sigHandler,
-		.sa_flags	= 0,
-	};
+	// Receive packet
+	buf = lb_space(&bot.net->recv, &space);
+	retVal = read(bot.net->conn, buf, space);
+	if (retVal == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		com_pwarning("read");
+		ircReconnect(0);
+		return;
+	} else if (retVal == 0) { // FIN
+		com_warning("%s: Connection closed. Reconnecting...", bot.net->name);
+		ircReconnect(0);
+		return;
+	}
+	ev_timerSet(&bot.net->pingTimer, botTimeout * 1000LL, 0);
+	bot.net->recv.tail += retVal;
+
+	// Parse mesages
+	while ((msgStart = lb_nextLine(&bot.net->recv, &msgEnd))) {
+		long long start = com_nanoseconds();
+		long long parseEnd;
+		bool	parsed;
+
+		log_traffic('>', msgStart, msgEnd - msgStart);
+		bot.stats.messagesIn++;
+		bot.stats.bytesIn += msgEnd - msgStart;
+
+		parsed = parseMessage(msgStart, msgEnd, &message);
+		parseEnd = com_nanoseconds();
+		hist_add(&bot.stats.parseTime, parseEnd - start);
+		trace_span(TT_IRC, "parse", start, parseEnd);
+		if (parsed) {
+			messageReply(&message);
+			printLists();
+		} else {
+			bot.stats.parseErrors++;
+		}
+		trace_span(TT_IRC, "message", start, com_nanoseconds());
+	}
+}
 
-	memset(&act, 0, sizeof(act));
-	act.sa_handler = sigHandler;
-	sigemptyset(&act.sa_mask);
-	sigaction(SIGINT, &act, NULL);
+// Write queued output and watch for EPOLLOUT while some is left
+void ircSend(void)
+{
+	bool pending;
+
+	if (bot.net->conn == -1 || bot.net->state == NET_CONNECTING)
+		return;
+
+	if (!sq_send(&bot.net->sendq, bot.net->conn)) {
+		// Reading will report the error and reconnect
+		sq_clear(&bot.net->sendq);
+	}
+
+	pending = bot.net->sendq.head < bot.net->sendq.tail;
+	if (pending != bot.net->writePending) {
+		ev_modify(&bot.net->connEv, pending ? EPOLLIN | EPOLLOUT : EPOLLIN);
+		bot.net->writePending = pending;
+	}
+}
+
+// Move queued lines to the socket, most urgent class first, as fast
+// as the server's flood control lets us. It charges every line and
+// stops reading from us while the penalty exceeds botFloodBurst.
+void ircPump(void)
+{
+	sendQueue_t *queue;
+	long long now;
+	char	*line;
+	char	*end;
+	int	len;
+	int	i;
+
+	if (bot.net->conn == -1)
+		return;
+
+	now = com_milliseconds();
+	if (bot.net->floodClock < now)
+		bot.net->floodClock = now;
+
+	while (true) {
+		for (i = 0; i < OUT_CLASSES; i++)
+			if (bot.net->outq[i].head < bot.net->outq[i].tail)
+				break;
+		if (i == OUT_CLASSES)
+			break;
+#ifndef DEBUG_INTERCEPT
+		if (bot.net->floodClock - now >= botFloodBurst) {
+			ev_timerSet(&bot.net->floodTimer, bot.net->floodClock - now - botFloodBurst + 1, 0);
+			break;
+		}
+#endif
+		queue = &bot.net->outq[i];
+		line = queue->data + queue->head;
+		end = memchr(line, '\n', queue->tail - queue->head);
+		len = end + 1 - line;
+
+		log_traffic('<', line, len - 2);
+		if (sq_push(&bot.net->sendq, line, len)) {
+			bot.stats.linesOut++;
+			bot.stats.bytesOut += len;
+		} else {
+			com_warning("ircPump: Send queue full, dropping %.*s", len - 2, line);
+			bot.stats.outputDropped++;
+		}
+		bot.net->outLines--;
+
+		queue->head += len;
+		if (queue->head == queue->tail)
+			sq_clear(queue);
+		bot.net->floodClock += botFloodLineCost + len * 1000LL / botFloodByteRate;
+	}
 
-	initPickups();
-	setTopic(botTopic);
-	assert(irc_validateNick(botNick));
-connect:
-	bot.cursor = bot.sbuf;
-	forgetPlayers(bot.playerList);
 #ifdef DEBUG_INTERCEPT
-	bot.conn = STDIN_FILENO;
+	sq_clear(&bot.net->sendq);
 #else
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	if (res) {
-		freeaddrinfo(res);
-		res = NULL;
+	ircSend();
+#endif
+}
+
+void floodTimeout(evtimer_t *timer)
+{
+	bot.net = timer->ctx;
+	ircPump();
+}
+
+// Check how the non-blocking connect went
+bool ircConnected(void)
+{
+	socklen_t len = sizeof(int);
+	int	err;
+
+	if (getsockopt(bot.net->conn, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		err = errno;
+	if (err) {
+		com_warning("connect: %s", strerror(err));
+		ircDisconnect();
+		bot.stats.reconnects++;
+		// Address might have changed
+		resolve(&bot.net->resolve);
+		ev_timerSet(&bot.net->reconnectTimer, botTimeout * 1000LL, 0);
+		return false;
 	}
-	retVal = getaddrinfo(botHost, botPort, &hints, &res);
-	if (retVal) {
-		com_warning("getaddrinfo: %s", gai_strerror(retVal));
-		sleep(botTimeout);
-		goto connect;
+
+	bot.net->state = NET_REGISTERING;
+	return true;
+}
+
+void ircEvent(event_t *ev, uint32_t events)
+{
+	bot.net = ev->ctx;
+	if (bot.net->state == NET_CONNECTING && !ircConnected())
+		return;
+	if (events & EPOLLOUT)
+		ircSend();
+	if (bot.net->conn != -1 && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		ircRead();
+}
+
+void pingTimeout(evtimer_t *timer)
+{
+	bot.net = timer->ctx;
+	com_warning("%s: Ping timeout. Reconnecting...", bot.net->name);
+	ircReconnect(0);
+}
+
+void reconnectTimeout(evtimer_t *timer)
+{
+	bot.net = timer->ctx;
+	ircConnect();
+}
+
+void ircResolved(resolveJob_t *job)
+{
+	bot.net = job->ctx;
+	if (bot.net->state != NET_RESOLVING)
+		return;
+
+	bot.net->state = NET_IDLE;
+	if (job->resolved)
+		ircConnect();
+	else
+		ev_timerSet(&bot.net->reconnectTimer, botTimeout * 1000LL, 0);
+}
+
+void ircConnect(void)
+{
+	bot.net->cursor = bot.net->sbuf;
+	bot.net->maxTargets = DEFAULT_MAXTARGETS;
+	bot.net->relayPrefixLen = strlen(bot.net->nick) + DEFAULT_USERLEN + DEFAULT_HOSTLEN + 4;
+#ifdef DEBUG_INTERCEPT
+	bot.net->conn = STDIN_FILENO;
+#else
+	if (!bot.net->resolve.resolved) {
+		resolve(&bot.net->resolve);
+		if (bot.net->resolve.busy) {
+			// ircResolved will call us back
+			bot.net->state = NET_RESOLVING;
+			return;
+		}
+		if (!bot.net->resolve.resolved) {
+			ev_timerSet(&bot.net->reconnectTimer, botTimeout * 1000LL, 0);
+			return;
+		}
 	}
-	bot.conn = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	if (bot.conn == -1) {
-		perror("socket");
-		sleep(botTimeout);
-		goto connect;
+
+	bot.net->conn = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (bot.net->conn == -1) {
+		com_pwarning("socket");
+		ev_timerSet(&bot.net->reconnectTimer, botTimeout * 1000LL, 0);
+		return;
 	}
-	retVal = connect(bot.conn, res->ai_addr, res->ai_addrlen);
-	if (retVal == -1) {
-		perror("connect");
-		sleep(botTimeout);
-		goto connect;
+	if (connect(bot.net->conn, (struct sockaddr *)&bot.net->resolve.addr,
+		    sizeof(bot.net->resolve.addr)) == -1 && errno != EINPROGRESS) {
+		com_pwarning("connect");
+		close(bot.net->conn);
+		bot.net->conn = -1;
+		bot.stats.reconnects++;
+		// Address might have changed
+		resolve(&bot.net->resolve);
+		ev_timerSet(&bot.net->reconnectTimer, botTimeout * 1000LL, 0);
+		return;
 	}
+	// ircEvent finishes connecting once the socket becomes writable
+	bot.net->state = NET_CONNECTING;
+	bot.net->writePending = true;
 #endif // !DEBUG_INTERCEPT
-	bot_printf("NICK %s\r\n", botNick);
-	bot_printf("USER %s 0 * :%s\r\n", botNick, botRealName);
+	bot.net->connEv.fd = bot.net->conn;
+	bot.net->connEv.callback = ircEvent;
+	if (!ev_add(&bot.net->connEv, bot.net->state == NET_CONNECTING ?
+		    EPOLLIN | EPOLLOUT : EPOLLIN)) {
+		ircReconnect(botTimeout);
+		return;
+	}
+	ev_timerSet(&bot.net->pingTimer, botTimeout * 1000LL, 0);
 
-	msgLen = 0;
-	while (true) {
-		// Wait for a TCP packet
-		FD_ZERO(&set);
-		FD_SET(bot.conn, &set);
-		timeout.tv_sec = botTimeout;
-		timeout.tv_usec = 0;
-		retVal = select(bot.conn + 1, &set, NULL, NULL, &timeout);
-		if (retVal == -1) {
-			perror("select");
-			sleep(botTimeout);
-			goto connect;
-		} else if (retVal == 0) {
-			com_warning("Ping timeout. Reconnecting...");
-			goto connect;
-		}
+	bot_printf("NICK %s\r\n", bot.net->nick);
+	bot_printf("USER %s 0 * :%s\r\n", bot.net->nick, bot.net->realName);
+	if (bot.net->state == NET_IDLE)
+		bot.net->state = NET_REGISTERING;
+}
 
-		// Receive packet
-		assert(sizeof(buf) - msgLen - 1 > 0);
-		retVal = read(bot.conn, &buf[msgLen], sizeof(buf) - msgLen - 1);
-		if (retVal == -1) {
-			perror("read");
-			goto connect;
-		} else if (retVal == 0) { // FIN
-			com_warning("Connection closed. Reconnecting...");
-			goto connect;
-		}
-		bufEnd = &buf[msgLen + retVal];
-		*bufEnd = '\0';
-
-		// Parse mesages
-		msgStart = buf;
-		while ((msgEnd = strstr(msgStart, "\r\n"))) {
-			if (parseMessage(msgStart, msgEnd, &message)) {
-				messageReply(&message);
-				printLists();
-			}
+void initNetworks(void)
+{
+	network_t *net;
+	int i;
 
-			msgStart = msgEnd + 2;
-		}
+	bot.networks = networksArray;
+	bot.networkCount = sizeof(networksArray) / sizeof(*networksArray);
+
+	for (i = 0; i < bot.networkCount; i++) {
+		net = bot.net = &networksArray[i];
+		assert(irc_validateNick(net->nick));
+
+		net->conn = -1;
+		net->connEv.fd = -1;
+		net->connEv.ctx = net;
+		net->outClass = OUT_AUTO;
+		net->cursor = net->sbuf;
+		net->resolve.host = net->host;
+		net->resolve.port = net->port;
+		net->resolve.socktype = SOCK_STREAM;
+		net->resolve.done = ircResolved;
+		net->resolve.ctx = net;
+		setNickLen(DEFAULT_NICKLEN);
+
+		ev_timerInit(&net->pingTimer, pingTimeout);
+		ev_timerInit(&net->reconnectTimer, reconnectTimeout);
+		ev_timerInit(&net->floodTimer, floodTimeout);
+		ev_timerInit(&net->statusTimer, statusTimeout);
+		net->pingTimer.ctx = net;
+		net->reconnectTimer.ctx = net;
+		net->floodTimer.ctx = net;
+		net->statusTimer.ctx = net;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int i;
 
-		// Save partial message for next read
-		msgLen = 0;
-		if (msgStart < bufEnd) {
-			msgLen = bufEnd - msgStart;
-			if (msgLen < MAX_MSG_LEN)
-				memmove(buf, msgStart, msgLen);
-			else
-				msgLen = 0;
+	// Options override the first network
+	while ((opt = getopt(argc, argv, "s:p:")) != -1) {
+		switch (opt) {
+		case 's':
+			networksArray[0].host = optarg;
+			break;
+		case 'p':
+			networksArray[0].port = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s server] [-p port]\n", argv[0]);
+			return EXIT_FAILURE;
 		}
+	}
+
+	initLog();
+	initTrace();
+	initCommands();
+	ev_init();
+	initNetworks();
+	initPickups();
+	initSnapshot();
+	initSignals();
+	initResolver();
+#ifdef DEBUG_BENCHMARK
+	bot.benchStart = com_nanoseconds();
+#else
+	resolveTimerCallback(&bot.resolveTimer);
+#endif
+	initQueries();
+	initMetrics();
+	for (i = 0; i < bot.networkCount; i++) {
+		bot.net = &bot.networks[i];
+#ifdef DEBUG_INTERCEPT
+		// There's only one stdin
+		if (i)
+			break;
+#endif
+		ircConnect();
+	}
 
-		if (bot.statusChanged)
-			updateStatus();
+	while (true) {
+		ev_dispatch(-1);
 
-		// Send messages
-		bot_flush();
+		for (i = 0; i < bot.networkCount; i++) {
+			bot.net = &bot.networks[i];
+			if (bot.net->conn == -1)
+				continue;
+			if (bot.net->statusChanged)
+				scheduleStatus();
+
+			// Send messages
+			bot_flush();
+		}
+		snap_flush();
+		log_flush();
 	}
 }
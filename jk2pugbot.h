@@ -19,31 +19,153 @@
 #define _MYIRCBOT_H_
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/select.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+// Replay benchmark reads irc traffic from stdin too
+#if defined(DEBUG_BENCHMARK) && !defined(DEBUG_INTERCEPT)
+#define DEBUG_INTERCEPT
+#endif
 
 #define MAX_MSG_LEN 512
+#define MAX_TAGS_LEN 8191
+#define MAX_MSG_PARAMS 32
 #define MAX_Q3_INFO_LEN 1024
+#define MAX_STATUS_LEN 64	// pickup part of the channel topic
+#define MAX_LINE_LEN (MAX_TAGS_LEN + 1 + MAX_MSG_LEN)
 
 #define SEND_BUF_SIZE 4096
-#define RECV_BUF_SIZE 4096
+#define LOG_BUF_SIZE 16384
+#define RECV_BUF_SIZE 16384	// must hold at least one MAX_LINE_LEN line
+
+#define EV_MAX_EVENTS 16
+#define POOL_ALIGN 8
+#define SLAB_OBJS 64
+#define DEFAULT_NICKLEN 15	// until RPL_ISUPPORT says otherwise
+#define DEFAULT_MAXTARGETS 4
+#define DEFAULT_USERLEN 10	// for relayed prefix until we see our own
+#define DEFAULT_HOSTLEN 63
+#define NICK_TABLE_MIN_SIZE 64
+#define MAX_PICKUPS 32		// per channel, bits in pickupMask_t
+#define MAX_CHANNELS 64		// per network, bits in channelMask_t
+#define DISPATCH_TABLE_BITS 6
+#define DISPATCH_TABLE_SIZE (1 << DISPATCH_TABLE_BITS)
+#define HIST_BUCKETS 40		// last one counts everything bigger
+#define SNAPSHOT_MAGIC "JK2SNAP"
+#define SNAPSHOT_VERSION 2	// bump when snapshot records change
+#define SNAPSHOT_NAME_LEN 64	// names are told apart by this many characters
+#define SNAPSHOT_ROSTER 64	// players saved per pickup, most recent first
+#define SNAPSHOT_SLACK 4096	// spare roster bytes when the file grows
 
 enum sv_type {
 	SV_NONE = 0,
 	SV_Q3
 };
 
+enum log_level {
+	LL_DEBUG = 0,
+	LL_INFO,
+	LL_WARNING,
+	LL_ERROR
+};
+
+// Output priority classes, most urgent first
+enum out_class {
+	OUT_AUTO = -1,	// pick by command
+	OUT_URGENT,	// PONG and registration
+	OUT_HIGHLIGHT,	// pickup is ready to start
+	OUT_TOPIC,
+	OUT_NORMAL,	// command replies
+	OUT_CLASSES
+};
+
+// Connection and registration with an irc server
+enum net_state {
+	NET_IDLE = 0,		// disconnected, maybe waiting to reconnect
+	NET_RESOLVING,		// connect once the address is known
+	NET_CONNECTING,		// non-blocking connect in progress
+	NET_REGISTERING,	// sent NICK and USER, waiting for RPL_WELCOME
+	NET_REGISTERED
+};
+
+enum sv_status {
+	SV_UNKNOWN = 0,	// never queried
+	SV_UP,		// replied with server info
+	SV_DOWN,	// didn't reply in time
+	SV_ERROR	// couldn't query
+};
+
+typedef struct slab_s {
+	struct slab_s *next;
+} slab_t;
+
+// Fixed-size object allocator. Objects are carved from slabs that
+// are never returned to the system until the pool is destroyed.
+typedef struct pool_s {
+	size_t objSize;
+	int slabObjs;		// objects per slab
+	int maxObjs;		// 0 for unlimited
+	int objs;		// allocated from slabs so far
+	int used;
+	void *freeList;
+	slab_t *slabs;
+} pool_t;
+
+typedef struct event_s {
+	int fd;
+	void (*callback)(struct event_s *ev, uint32_t events);
+	void *ctx;
+
+	// Regular files can't be polled, they are always ready
+	bool alwaysReady;
+	struct event_s *nextReady;
+} event_t;
+
+typedef struct evtimer_s {
+	event_t ev;
+	void (*callback)(struct evtimer_s *timer);
+	void *ctx;		// for the callback
+} evtimer_t;
+
+typedef struct resolveJob_s {
+	const char *host;
+	const char *port;
+	int socktype;
+	void (*done)(struct resolveJob_s *job);
+	void *ctx;
+
+	// Owned by the resolver thread while busy
+	bool busy;
+	int error;		// getaddrinfo return value
+	struct sockaddr_in result;
+
+	// Cached address
+	bool resolved;
+	struct sockaddr_in addr;
+	long long updated;
+} resolveJob_t;
+
 typedef struct q3serverInfo_s {
 	int maxclients;
 	int clients;
@@ -58,22 +180,121 @@ struct prefix_s {
 	char *host;
 };
 
+// Received data waiting to be split into lines. Lines are parsed in
+// place and the unfinished tail is moved to the front only when the
+// buffer runs out of space at the end.
+typedef struct lineBuffer_s {
+	char data[RECV_BUF_SIZE];
+	int head;		// start of the first unparsed line
+	int scan;		// no '\n' between head and scan
+	int tail;		// end of received data
+	bool discard;		// skipping the rest of an oversize line
+} lineBuffer_t;
+
+// Log output collected until the end of an event loop iteration
+typedef struct logBuffer_s {
+	int fd;
+	int len;
+	char data[LOG_BUF_SIZE];
+} logBuffer_t;
+
+// Binary traffic log record followed by len bytes of the line
+typedef struct __attribute__ ((packed)) trafficRecord_s {
+	uint32_t time;		// seconds since the epoch
+	uint16_t len;
+	uint8_t dir;		// '>' received or '<' sent
+} trafficRecord_t;
+
+// Bucket i counts values in (2^(i-1), 2^i]
+typedef struct histogram_s {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[HIST_BUCKETS];
+} histogram_t;
+
+typedef struct stats_s {
+	time_t started;
+	uint64_t messagesIn;
+	uint64_t bytesIn;
+	uint64_t parseErrors;
+	uint64_t linesOut;
+	uint64_t bytesOut;
+	uint64_t outputDropped;
+	uint64_t reconnects;
+	uint64_t queriesSent;
+	uint64_t queryReplies;
+	uint64_t queryTimeouts;
+	histogram_t parseTime;				// nanoseconds
+	histogram_t ircTime[DISPATCH_TABLE_SIZE / 2];	// per ircCommands entry
+	histogram_t botTime[DISPATCH_TABLE_SIZE / 2];	// per botCommands entry
+	histogram_t queryRtt;				// milliseconds
+	histogram_t queueDepth;				// lines waiting for flood control
+} stats_t;
+
+// Output waiting for the irc server socket to become writable
+typedef struct sendQueue_s {
+	char *data;
+	int size;
+	int head;		// first unsent byte
+	int tail;		// end of queued data
+} sendQueue_t;
+
+// Builds PRIVMSG lines out of items, starting a new line whenever
+// the next item wouldn't fit into the relayed message
+typedef struct linePacker_s {
+	char line[MAX_MSG_LEN];
+	int len;
+	int headLen;		// "PRIVMSG <targets> :" starts every line
+	int maxLen;
+	const char *sep;	// between items on one line
+	bool needSep;
+} linePacker_t;
+
+// Message parts point into the received line, which is split with
+// '\0' in place. Parameters are terminated with NULL like argv.
 typedef struct message_s {
+	char *tags;		// raw IRCv3 message tags or NULL
+	int tagsLen;
 	struct prefix_s prefix;
 	char *command;
-	char *parameter[14];
+	int commandLen;
+	char *parameter[MAX_MSG_PARAMS + 1];	// <middle> parameters
+	int paramLen[MAX_MSG_PARAMS];
+	int paramCount;
 	char *trailing;
+	int trailingLen;
 } message_t;
 
+typedef uint32_t pickupMask_t;
+typedef uint64_t channelMask_t;
+
+// One record per nick, shared by all channels the player is in
 typedef struct player_s {
-	char *nick;
-	bool op;
+	unsigned hash;		// irc_hashNick(nick)
+	channelMask_t channels;	// bit set for each channel_t.id we saw them in
+	channelMask_t ops;	// and for each channel where they are an op
+	channelMask_t named;	// and for each channel whose NAMES list had them
+	pickupMask_t pickups;	// bit set for each pickup_t.id joined in any channel
+	struct member_s *memberships;
+	char nick[];		// up to bot.nickLen characters
 } player_t;
 
-typedef struct playerNode_s {
+// Open addressing hash table of players keyed by casemapped nick
+typedef struct nickTable_s {
+	player_t **slots;
+	unsigned size;		// power of two
+	unsigned count;
+} nickTable_t;
+
+// Player added to a pickup. Links player into the pickup roster and
+// pickup into the player's memberships list.
+typedef struct member_s {
 	player_t *player;
-	struct playerNode_s *next;
-} playerNode_t;
+	struct pickup_s *pickup;
+	struct member_s *prev;
+	struct member_s *next;
+	struct member_s *nextMembership;
+} member_t;
 
 typedef struct server_s {
 	const char *name;
@@ -81,19 +302,31 @@ typedef struct server_s {
 	const char *port;
 	const char *games;
 	enum sv_type type;
+
+	// Status cache
+	resolveJob_t resolve;
+	q3serverInfo_t info;
+	enum sv_status status;
+	long long updated;	// when status was last refreshed
+	long long queryDeadline;	// query in flight expires then, or 0
+	int snapId;		// record in the snapshot file
 } server_t;
 
 typedef struct serverNode_s {
-	const server_t *server;
+	server_t *server;
 	struct serverNode_s *next;
 } serverNode_t;
 
 typedef struct pickup_s {
 	const char *name;
 	serverNode_t *serverList;
-	playerNode_t *playerList;
+	member_t *playerList;	// most recently added first
+	struct channel_s *channel;
+	int id;			// bit in player_t.pickups, unique in the channel
 	int count;
 	int max;
+	char status[MAX_STATUS_LEN];	// part of the channel topic
+	int statusLen;
 } pickup_t;
 
 typedef struct pickupNode_s {
@@ -101,10 +334,158 @@ typedef struct pickupNode_s {
 	struct pickupNode_s *next;
 } pickupNode_t;
 
+typedef struct channel_s {
+	const char *network;	// network_t name
+	const char *name;
+	const char *games;	// pickups played in the channel
+
+	struct network_s *net;
+	int id;			// bit in player_t.channels
+	pickupNode_t *pickupList;	// channel's own copies of pickupsArray
+	char *topic;
+	bool statusChanged;		// schedule a topic update
+	long long statusDue;		// update the topic then or 0
+	long long statusDeadline;	// and no later than that
+	char sentTopic[MAX_MSG_LEN];	// last topic we set or "" if unknown
+	int snapId;			// record in the snapshot file
+	bool snapSynced;		// rosters restored since we joined, save changes
+} channel_t;
+
+// Pickups and servers in use. Strings of a loaded configuration point
+// into its text.
+typedef struct config_s {
+	char *text;			// or NULL for the compiled in arrays
+	pickup_t *pickups;		// templates channels copy
+	int pickupCount;
+	server_t *servers;
+	int serverCount;
+	const char **games;		// per channelsArray entry, NULL keeps .games
+} config_t;
+
+// Connection to an irc network and everything we know about it. All
+// networks share one event loop, game servers and pickup definitions.
+typedef struct network_s {
+	const char *name;
+	const char *host;
+	const char *port;
+	const char *nick;
+	const char *realName;
+	const char *qPassword;	// password to auth with Q or NULL
+
+	enum net_state state;
+	int conn;			// irc server socket file descriptor
+	event_t connEv;
+	evtimer_t pingTimer;		// reconnect if irc server goes silent
+	evtimer_t reconnectTimer;
+	resolveJob_t resolve;		// irc server address
+	bool writePending;		// waiting for EPOLLOUT
+	lineBuffer_t recv;
+
+	char sbuf[SEND_BUF_SIZE + 1];	// send buffer; +1 for closing \0 when printing
+	char *cursor;
+	sendQueue_t sendq;
+	sendQueue_t outq[OUT_CLASSES];	// lines waiting for flood control
+	int outClass;			// class of new lines or OUT_AUTO
+	long long floodClock;		// the server's idea of our flood penalty
+	evtimer_t floodTimer;
+	int outLines;			// in outq
+
+	channel_t **channels;
+	int channelCount;
+	bool statusChanged;		// some channel needs a topic update
+	evtimer_t statusTimer;		// for the channel whose update is due first
+
+	nickTable_t players;
+	pool_t playerPool;
+	int nickLen;			// nick capacity of playerPool objects
+	int maxTargets;			// per PRIVMSG or 0 if unlimited
+	int relayPrefixLen;		// ":nick!user@host " the server adds to our messages
+	player_t *self;
+} network_t;
+
+typedef struct announcement_s {
+	network_t *net;
+	pickupNode_t *pickupList;
+	char *to;
+	long long deadline;
+	int outClass;
+	struct announcement_s *next;
+} announcement_t;
+
+// Snapshot file is a header followed by a record for every channel
+// and every server, in configuration order, and then the roster area.
+// Records are rewritten in place through a shared mapping as the
+// state changes and read back as they are, so all strings in them are
+// fixed size and '\0' terminated.
+typedef struct snapHeader_s {
+	char magic[8];			// SNAPSHOT_MAGIC
+	uint32_t version;		// SNAPSHOT_VERSION
+	uint32_t channels;
+	uint32_t servers;
+	uint32_t rosterBytes;		// used part of the roster area
+	uint32_t rosterSpace;		// size of the roster area
+	uint32_t reserved;
+} snapHeader_t;
+
+typedef struct snapChannel_s {
+	char network[SNAPSHOT_NAME_LEN];
+	char name[SNAPSHOT_NAME_LEN];
+	char topic[MAX_MSG_LEN];
+} snapChannel_t;
+
+// Roster area holds one of these for every pickup that has players,
+// each followed by size bytes of '\0' terminated nicks. The area is
+// written as a whole whenever a roster changes.
+typedef struct snapRoster_s {
+	char pickup[SNAPSHOT_NAME_LEN];
+	uint32_t channel;		// snapChannel_t index
+	uint32_t count;			// nicks, most recent first
+	uint32_t size;			// multiple of 8
+	uint32_t reserved;
+} snapRoster_t;
+
+typedef struct snapServer_s {
+	char name[SNAPSHOT_NAME_LEN];
+	int32_t status;
+	int32_t clients;
+	int32_t maxclients;
+	int32_t reserved;
+	int64_t updated;		// wall clock milliseconds or 0
+} snapServer_t;
+
+// Entries are looked up by packed command name or numeric reply
+typedef struct dispatchTable_s {
+	uint64_t keys[DISPATCH_TABLE_SIZE];
+	const void *entries[DISPATCH_TABLE_SIZE];
+} dispatchTable_t;
+
+typedef struct ircCommand_s {
+	const char *name;	// or NULL for numeric replies
+	int numeric;
+	void (*handler)(message_t *message);
+	int minParams;		// ignore messages with fewer <middle> parameters
+} ircCommand_t;
+
+typedef struct botCommand_s {
+	const char *name;
+	void (*handler)(channel_t *channel, char *args, const char *replyTo,
+			const char *from);
+	const char *help;	// line in !help or NULL
+	bool opOnly;
+} botCommand_t;
+
 typedef enum {
 	RPL_WELCOME		= 001,
+	RPL_ISUPPORT		= 005,
 	RPL_NAMREPLY		= 353,
 	RPL_ENDOFNAMES		= 366,
+	ERR_NOSUCHCHANNEL	= 403,
+	ERR_TOOMANYCHANNELS	= 405,
+	ERR_CHANNELISFULL	= 471,
+	ERR_INVITEONLYCHAN	= 473,
+	ERR_BANNEDFROMCHAN	= 474,
+	ERR_BADCHANNELKEY	= 475,
+	ERR_NEEDREGGEDNICK	= 477,
 } reply_t;
 
 #endif // _MYIRCBOT_H_